@@ -0,0 +1,448 @@
+#include "opencv2/core/utility.hpp"
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+
+#include "Palette.h"
+#include "ImageUtils.h"
+#include "FileUtils.h"
+#include "Filter.h"
+#include "Merge.h"
+#include "HueThreshold.h"
+#include "Watershed.h"
+#include "Trace.h"
+
+// Every heap allocation of the process goes through here, so kernels can be compared
+// by how many temporaries they create, not only by time
+namespace {
+std::atomic<size_t> newCalls(0);
+std::atomic<size_t> newBytes(0);
+}
+
+void* operator new(size_t size) {
+    newCalls++;
+    newBytes += size;
+    void* p = std::malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+namespace {
+
+#if CV_VERSION_MAJOR >= 4
+typedef cv::AccessFlag MatAccessFlags;
+#else
+typedef int MatAccessFlags;
+#endif
+
+// cv::Mat buffers are allocated with fastMalloc, not operator new, count them separately
+class CountingMatAllocator : public cv::MatAllocator {
+public:
+    explicit CountingMatAllocator(cv::MatAllocator* base) : calls(0), bytes(0), base_(base) {}
+
+    mutable std::atomic<size_t> calls;
+    mutable std::atomic<size_t> bytes;
+
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+                           MatAccessFlags flags, cv::UMatUsageFlags usageFlags) const override {
+        cv::UMatData* u = base_->allocate(dims, sizes, type, data, step, flags, usageFlags);
+        if (u && !data) {
+            calls++;
+            bytes += u->size;
+        }
+        return u;
+    }
+
+    bool allocate(cv::UMatData* data, MatAccessFlags accessflags, cv::UMatUsageFlags usageFlags) const override {
+        return base_->allocate(data, accessflags, usageFlags);
+    }
+
+    void deallocate(cv::UMatData* data) const override {
+        base_->deallocate(data);
+    }
+
+private:
+    cv::MatAllocator* base_;
+};
+
+struct Inputs {
+    // "synthetic" or reference image file name
+    std::string source;
+    cv::Mat image;
+    // CV_8U, 255 where markers are drawn
+    cv::Mat markers;
+    // CV_8U watershed-like labels with invalid ones scattered around
+    cv::Mat labels;
+    cv::Mat thresholdLabels;
+    cv::Mat colors;
+};
+
+struct Kernel {
+    const char* name;
+    // untimed, restores what the kernel changes in place
+    std::function<void(const Inputs&, cv::Mat&)> setup;
+    std::function<void(const Inputs&, cv::Mat&)> run;
+};
+
+struct Result {
+    std::string kernel;
+    std::string source;
+    double megapixels;
+    int threads;
+    int reps;
+    double bestMs;
+    double medianMs;
+    double nsPerPixel;
+    double mpPerSecond;
+    double speedup;
+    size_t allocations;
+    size_t allocatedBytes;
+    size_t matAllocations;
+    size_t matBytes;
+};
+
+// cheap deterministic noise, rand() would make 100 MP images take longer than the kernels
+inline int noise(int x, int y, int amplitude) {
+    unsigned h = (unsigned)x * 374761393u + (unsigned)y * 668265263u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    return (int)((h ^ (h >> 16)) % (unsigned)amplitude);
+}
+
+void makeSyntheticImage(cv::Size size, cv::Mat& image) {
+    image.create(size, CV_8UC3);
+    cv::parallel_for_(cv::Range(0, size.height), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end; ++i) {
+            cv::Vec3b* row = image.ptr<cv::Vec3b>(i);
+            for (int j = 0; j < size.width; ++j) {
+                // fields of different colors with noisy texture
+                int field = ((i / 97) * 7 + (j / 131) * 3) % 5;
+                int v = 60 + field * 35 + noise(j, i, 24);
+                row[j] = cv::Vec3b((uchar)v, (uchar)(255 - v), (uchar)((v * field) & 255));
+            }
+        }
+    });
+}
+
+void makeSyntheticMarkers(cv::Size size, cv::Mat& markers) {
+    markers = cv::Mat::zeros(size, CV_8U);
+    const int step = 150;
+    for (int y = step / 2; y < size.height; y += step) {
+        for (int x = step / 2; x < size.width; x += step) {
+            cv::circle(markers, cv::Point(x, y), 6, cv::Scalar::all(255), -1);
+        }
+    }
+}
+
+void makeLabels(cv::Size size, cv::Mat& labels, cv::Mat& thresholdLabels) {
+    labels.create(size, CV_8U);
+    thresholdLabels.create(size, CV_8U);
+    cv::parallel_for_(cv::Range(0, size.height), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end; ++i) {
+            uchar* row = labels.ptr<uchar>(i);
+            uchar* thresholdRow = thresholdLabels.ptr<uchar>(i);
+            for (int j = 0; j < size.width; ++j) {
+                int n = noise(j, i, 100);
+                if (n < 4) {
+                    row[j] = notSpecifiedLabel;
+                } else if (n < 7) {
+                    row[j] = (uchar)(firstRegionLabel + n);
+                } else if (n < 10) {
+                    row[j] = n & 1 ? thresholdLowLabel : thresholdHighLabel;
+                } else {
+                    row[j] = (uchar)(((i / 37) + (j / 53)) % unknownLabel);
+                }
+                thresholdRow[j] = (j / 61) & 1 ? thresholdHighLabel : thresholdLowLabel;
+            }
+        }
+    });
+}
+
+bool makeInputs(const std::string& imagePath, double megapixels, Inputs& inputs) {
+    cv::Size size;
+    if (imagePath.empty()) {
+        int width = (int)std::sqrt(megapixels * 1e6 * 4 / 3);
+        size = cv::Size(width, (int)(megapixels * 1e6 / width));
+        inputs.source = "synthetic";
+        makeSyntheticImage(size, inputs.image);
+        makeSyntheticMarkers(size, inputs.markers);
+    } else {
+        cv::Mat reference = cv::imread(imagePath, cv::IMREAD_COLOR);
+        if (reference.empty()) {
+            std::cerr << "Can't read " << imagePath << std::endl;
+            return false;
+        }
+        double scale = std::sqrt(megapixels * 1e6 / reference.size().area());
+        size = cv::Size((int)(reference.cols * scale), (int)(reference.rows * scale));
+        inputs.source = imagePath;
+        cv::resize(reference, inputs.image, size, 0, 0, cv::INTER_LINEAR);
+
+        std::string markersPath = genMarkersFileName(imagePath);
+        cv::Mat markers = file_exists(markersPath) ? cv::imread(markersPath, cv::IMREAD_GRAYSCALE) : cv::Mat();
+        if (markers.empty()) {
+            makeSyntheticMarkers(size, inputs.markers);
+        } else {
+            cv::resize(markers, inputs.markers, size, 0, 0, cv::INTER_NEAREST);
+        }
+    }
+
+    makeLabels(size, inputs.labels, inputs.thresholdLabels);
+    colorizeLabels(inputs.labels, inputs.colors);
+    return true;
+}
+
+std::vector<Kernel> makeKernels(const LabelSet& validLabels) {
+    std::vector<Kernel> kernels;
+
+    auto copyLabels = [](const Inputs& in, cv::Mat& work) { in.labels.copyTo(work); };
+    auto nothing = [](const Inputs&, cv::Mat&) {};
+
+    kernels.push_back(Kernel{"invalidColorFilter", copyLabels, [validLabels](const Inputs&, cv::Mat& work) {
+        invalidColorFilter(work, validLabels, 10);
+    }});
+    kernels.push_back(Kernel{"slidingModeFilter", copyLabels, [validLabels](const Inputs&, cv::Mat& work) {
+        slidingModeFilter(work, validLabels, 5);
+    }});
+    kernels.push_back(Kernel{"recolorImg", [](const Inputs& in, cv::Mat& work) { in.colors.copyTo(work); },
+                             [](const Inputs&, cv::Mat& work) {
+        std::vector<cv::Vec3b> from = {labelColor(thresholdLowLabel), labelColor(thresholdHighLabel)};
+        std::vector<cv::Vec3b> to = {labelColor(grassLabel), labelColor(waterLabel)};
+        recolorImg(work, from, to);
+    }});
+    kernels.push_back(Kernel{"relabelImg", copyLabels, [](const Inputs&, cv::Mat& work) {
+        std::vector<uchar> from = {thresholdLowLabel, thresholdHighLabel};
+        std::vector<uchar> to = {grassLabel, waterLabel};
+        relabelImg(work, from, to);
+    }});
+    kernels.push_back(Kernel{"mergeMasks", copyLabels, [](const Inputs& in, cv::Mat& work) {
+        mergeMasks(work, in.thresholdLabels);
+    }});
+    kernels.push_back(Kernel{"colorizeLabels", nothing, [](const Inputs& in, cv::Mat& work) {
+        colorizeLabels(in.labels, work);
+    }});
+    kernels.push_back(Kernel{"runThresholdBasedMethod", nothing, [](const Inputs& in, cv::Mat& work) {
+        work = runThresholdBasedMethod(in.image);
+    }});
+    kernels.push_back(Kernel{"runWatershed", nothing, [](const Inputs& in, cv::Mat& work) {
+        work = runWatershed(in.image, in.markers, OPENCV_WATERSHED);
+    }});
+    kernels.push_back(Kernel{"runWatershed/parallel", nothing, [](const Inputs& in, cv::Mat& work) {
+        work = runWatershed(in.image, in.markers, PARALLEL_WATERSHED);
+    }});
+    kernels.push_back(Kernel{"runWatershed/pyramid", nothing, [](const Inputs& in, cv::Mat& work) {
+        work = runWatershed(in.image, in.markers, PYRAMID_WATERSHED);
+    }});
+    kernels.push_back(Kernel{"overlayMarkers", nothing, [](const Inputs& in, cv::Mat& work) {
+        overlayMarkers(in.image, in.markers, work, cv::Vec3b(0, 0, 255));
+    }});
+
+    return kernels;
+}
+
+template<typename T>
+std::vector<T> parseList(const std::string& list) {
+    std::vector<T> values;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            T value;
+            std::stringstream(item) >> value;
+            values.push_back(value);
+        }
+    }
+    return values;
+}
+
+bool selected(const std::string& filter, const std::string& name) {
+    if (filter.empty()) {
+        return true;
+    }
+    std::vector<std::string> names = parseList<std::string>(filter);
+    return std::find(names.begin(), names.end(), name) != names.end();
+}
+
+Result measure(const Kernel& kernel, const Inputs& inputs, int threads, int reps,
+               const CountingMatAllocator& matAllocator) {
+    Result result;
+    result.kernel = kernel.name;
+    result.source = inputs.source;
+    result.megapixels = inputs.image.size().area() / 1e6;
+    result.threads = threads;
+    result.reps = reps;
+    result.speedup = 1;
+
+    std::vector<double> times;
+    cv::Mat work;
+    for (int r = 0; r < reps; ++r) {
+        kernel.setup(inputs, work);
+
+        size_t calls0 = newCalls, bytes0 = newBytes;
+        size_t matCalls0 = matAllocator.calls, matBytes0 = matAllocator.bytes;
+
+        double t = (double)cv::getTickCount();
+        kernel.run(inputs, work);
+        times.push_back(((double)cv::getTickCount() - t) * 1000. / cv::getTickFrequency());
+
+        // the same every rep, keep the last one
+        result.allocations = newCalls - calls0;
+        result.allocatedBytes = newBytes - bytes0;
+        result.matAllocations = matAllocator.calls - matCalls0;
+        result.matBytes = matAllocator.bytes - matBytes0;
+    }
+
+    std::sort(times.begin(), times.end());
+    result.bestMs = times.front();
+    result.medianMs = times[times.size() / 2];
+
+    const double pixels = (double)inputs.image.size().area();
+    result.nsPerPixel = result.bestMs * 1e6 / pixels;
+    result.mpPerSecond = pixels / 1e6 / (result.bestMs / 1000.);
+    return result;
+}
+
+void printResult(const Result& r) {
+    std::cout << std::left << std::setw(26) << r.kernel << std::right << std::fixed
+              << std::setprecision(1) << std::setw(8) << r.megapixels
+              << std::setw(6) << r.threads
+              << std::setprecision(2) << std::setw(12) << r.bestMs << std::setw(12) << r.medianMs
+              << std::setw(10) << r.nsPerPixel << std::setw(10) << r.mpPerSecond
+              << std::setw(9) << r.speedup
+              << std::setw(10) << r.allocations << std::setw(8) << r.matAllocations
+              << std::setprecision(1) << std::setw(10) << r.matBytes / (1024. * 1024.) << std::endl;
+}
+
+bool writeJson(const std::string& filename, const std::vector<Result>& results) {
+    std::ofstream out(filename.c_str());
+    if (!out) {
+        return false;
+    }
+
+    out << std::setprecision(6)
+        << "{\n  \"opencv\": \"" << CV_VERSION << "\",\n"
+        << "  \"cpus\": " << cv::getNumberOfCPUs() << ",\n"
+        << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << (i ? ",\n" : "\n")
+            << "    {\"kernel\": " << jsonString(r.kernel.c_str()) << ", \"source\": " << jsonString(r.source.c_str())
+            << ", \"megapixels\": " << r.megapixels << ", \"threads\": " << r.threads
+            << ", \"reps\": " << r.reps << ", \"best_ms\": " << r.bestMs
+            << ", \"median_ms\": " << r.medianMs << ", \"ns_per_pixel\": " << r.nsPerPixel
+            << ", \"mp_per_s\": " << r.mpPerSecond << ", \"speedup\": " << r.speedup
+            << ", \"allocations\": " << r.allocations << ", \"allocated_bytes\": " << r.allocatedBytes
+            << ", \"mat_allocations\": " << r.matAllocations << ", \"mat_bytes\": " << r.matBytes << "}";
+    }
+    out << "\n  ]\n}\n";
+
+    return (bool)out;
+}
+
+void help() {
+    std::cout << "Benchmarks every segmentation kernel on synthetic or reference images\n"
+                 "Usage:\n"
+                 "./watershed_bench [--sizes=1,10,100] [--threads=1,2,4,...] [--reps=3]\n"
+                 "\t[--image=<reference image, its _zMarkers.png is used if exists>]\n"
+                 "\t[--kernels=name1,name2] [--json=bench.json]\n"
+                 "Sizes are in megapixels, threads default to powers of 2 up to the number of CPUs.\n"
+                 "Speedup is relative to the first thread count." << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    cv::CommandLineParser parser(argc, argv,
+                                 "{help h | | }{sizes | 1,10,100 | }{threads | | }{reps | 3 | }"
+                                 "{image | | }{kernels | | }{json | bench.json | }");
+    if (parser.has("help")) {
+        help();
+        return 0;
+    }
+
+    std::vector<double> sizes = parseList<double>(parser.get<std::string>("sizes"));
+    std::vector<int> threadCounts = parseList<int>(parser.get<std::string>("threads"));
+    if (threadCounts.empty()) {
+        for (int t = 1; t < cv::getNumberOfCPUs(); t *= 2) {
+            threadCounts.push_back(t);
+        }
+        threadCounts.push_back(cv::getNumberOfCPUs());
+    }
+    const int reps = std::max(1, parser.get<int>("reps"));
+    const std::string imagePath = parser.get<std::string>("image");
+    const std::string kernelsFilter = parser.get<std::string>("kernels");
+    const std::string jsonPath = parser.get<std::string>("json");
+
+    CountingMatAllocator matAllocator(cv::Mat::getStdAllocator());
+    cv::Mat::setDefaultAllocator(&matAllocator);
+
+    LabelSet validLabels;
+    initLabelSet(validLabels);
+    const std::vector<Kernel> kernels = makeKernels(validLabels);
+
+    std::cout << std::left << std::setw(26) << "kernel" << std::right << std::setw(8) << "MP"
+              << std::setw(6) << "thr" << std::setw(12) << "best ms" << std::setw(12) << "median ms"
+              << std::setw(10) << "ns/px" << std::setw(10) << "MP/s" << std::setw(9) << "speedup"
+              << std::setw(10) << "allocs" << std::setw(8) << "mats" << std::setw(10) << "mat MB" << std::endl;
+
+    std::vector<Result> results;
+    for (size_t s = 0; s < sizes.size(); ++s) {
+        Inputs inputs;
+        if (!makeInputs(imagePath, sizes[s], inputs)) {
+            return 1;
+        }
+
+        for (size_t k = 0; k < kernels.size(); ++k) {
+            if (!selected(kernelsFilter, kernels[k].name)) {
+                continue;
+            }
+
+            double baseMs = 0;
+            for (size_t t = 0; t < threadCounts.size(); ++t) {
+                cv::setNumThreads(threadCounts[t]);
+                Result result = measure(kernels[k], inputs, threadCounts[t], reps, matAllocator);
+                if (t == 0) {
+                    baseMs = result.bestMs;
+                }
+                result.speedup = baseMs / result.bestMs;
+
+                printResult(result);
+                results.push_back(result);
+            }
+        }
+    }
+
+    cv::Mat::setDefaultAllocator(0);
+
+    if (!jsonPath.empty()) {
+        if (!writeJson(jsonPath, results)) {
+            std::cerr << "Can't write " << jsonPath << std::endl;
+            return 1;
+        }
+        std::cout << "Results saved to " << jsonPath << std::endl;
+    }
+
+    return 0;
+}
@@ -1,15 +1,27 @@
 #include "opencv2/highgui.hpp"
 
+#include <cmath>
 #include <iostream>
-#include <unistd.h>
-#include <unordered_set>
-#include <unordered_map>
 
 #include "watershed/Watershed.h"
 #include "utils/ColorTypesExtensions.h"
 #include "threshold/HueThreshold.h"
 #include "ImageUtils.h"
 #include "Filter.h"
+#include "Palette.h"
+#include "Merge.h"
+#include "FileUtils.h"
+#include "Batch.h"
+#include "Trace.h"
+#include "JobRunner.h"
+#include "RegionIndex.h"
+#include "LabelFile.h"
+#include "Segmenter.h"
+#include "Service.h"
+#include "EditHistory.h"
+#include "ClassStats.h"
+#include "TileExport.h"
+#include "TiledPipeline.h"
 
 using namespace cv;
 using namespace std;
@@ -18,7 +30,21 @@ static void help()
 {
     cout << "\nThis program demonstrates the famous watershed segmentation algorithm in OpenCV: watershed()\n"
             "Usage:\n"
-            "./watershed [image_name -- default is ../data/fruits.jpg]\n" << endl;
+            "./watershed [image_name -- default is ../data/fruits.jpg] [--history_mb=256] [--tile_budget=1024]\n"
+            "\t(images over the tile budget are edited scaled down, markers and mask are saved at full size)\n"
+            "./watershed --batch=<images_dir or manifest> [--threads=N] [--winsize=10] [--filter=block|sliding]\n"
+            "\t[--watershed=opencv|parallel|pyramid [--validate] [--pyramid_levels=2] [--pyramid_band=4]]\n"
+            "\t[--resolve_boundaries]\n"
+            "\t[--format=png|lbl] [--trace=trace.json] [--tiled [--tile=0] [--halo=64] [--tile_budget=1024] [--validate_tiles]]\n"
+            "\t(headless mode: segments every image using its _zMarkers.png and saves _mask.png)\n"
+            "./watershed --serve=<unix socket path> [--threads=N] [--queue=64] [--batch_max=8] [--small_mb=4]\n"
+            "\t[pipeline options as for --batch]\n"
+            "\t(service mode: segments images on requests coming through the socket, see Service.h)\n"
+            "./watershed --export=<images_dir or manifest> --export_dir=<dir> [--threads=N]\n"
+            "\t[--export_tile=256] [--export_stride=0] [--max_ignored=0.5] [--min_classes=1] [--min_class_fraction=0.05]\n"
+            "\t(cuts every image and its _mask into training tiles with manifest.csv, see TileExport.h)\n"
+            "./watershed --convert=<file.png or file.lbl>\n"
+            "\t(converts mask or markers between PNG and the label file format)\n" << endl;
 
 
     cout << "Hot keys: \n"
@@ -28,75 +54,148 @@ static void help()
             "\t\t(before running it, *roughly* mark the areas to segment on the image)\n"
             "\t  (before that, roughly outline several markers on the image)\n"
             "\tm - switch on/off color selecting mode\n"
-            "\tz - save mask\n"
+            "\tz - save mask (with its class statistics in _stats.csv and _stats.json)\n"
             "\tl - load mask\n"
             "\tf - apply filter\n"
+            "\tF - apply sliding window filter (slower, but without block artifacts)\n"
+            "\tc - cancel running operation\n"
+            "\ti - show class statistics of the mask\n"
+            "\tp - switch watershed engine (opencv, parallel, pyramid)\n"
+            "\tv - switch on/off validating watershed engine against opencv\n"
+            "\tb - switch on/off assigning watershed boundaries to neighbouring regions\n"
+            "\tu - undo the last edit of markers or mask\n"
+            "\ty - redo\n"
             "\t1-9 - set brush thickness\n"
             "\th - refresh image" << endl;
 }
-Mat markerMask, img, img0, curMask;
-CvScalar curColor = CV_RGB(0, 0, 0);
+Mat markerMask, img, img0, curMask, curMaskColors;
+uchar curLabel = unknownLabel;
 Point prevPt(-1, -1);
 int curThickness = 5;
+// masks and markers are saved as label files (see LabelFile.h) instead of PNG
+bool useLabelFiles = false;
 
-// terrain
-const CvScalar justTerrainColor = CV_RGB(102, 51, 0);
-const CvScalar snowColor = CV_RGB(204, 255, 255);
-const CvScalar sandColor = CV_RGB(255, 255, 51);
-const CvScalar forestColor = CV_RGB(0, 102, 0);
-const CvScalar grassColor = CV_RGB(51, 255, 51);
+// Images over the tile budget are read through ImageSource scaled down viewFactor times and edited so,
+// markers and masks are scaled to imageSize when saved and down to the view when loaded
+int viewFactor = 1;
+Size imageSize;
 
-const CvScalar roadsColor = CV_RGB(160, 160, 160);
+inline Mat toImageResolution(const Mat& labels) {
+    if (viewFactor == 1) {
+        return labels;
+    }
+    Mat scaled;
+    resize(labels, scaled, Size(labels.cols * viewFactor, labels.rows * viewFactor), 0, 0, INTER_NEAREST);
+    return scaled(Rect(0, 0, imageSize.width, imageSize.height));
+}
+
+inline Mat toViewResolution(const Mat& labels) {
+    if (viewFactor == 1) {
+        return labels;
+    }
+    MatImageSource source(labels);
+    return readDownsampled(source, viewFactor, INTER_NEAREST);
+}
+
+// keeps the last watershed result, markers changed since then
+Segmenter segmenter;
+Rect markersDirty;
+// main image area strokes changed since its last redraw
+Rect overlayDirty;
+WatershedOptions wshedOptions;
+
+// snapshot a background watershed run works on and its results
+struct WatershedJob {
+    Mat markers;
+    Rect dirty;
+    Segmenter segmenter;
+    Mat mask, preview;
+    RegionIndex regions;
+};
+
+// watershed, threshold merge and filters run in background, see JobRunner.
+// Any direct edit of the mask or markers supersedes the job in flight.
+JobRunner jobs;
+const int JOB_POLL_MS = 30;
+
+// regions of curMask for mark() and class statistics. Jobs replacing curMask build it for their result,
+// edits keep it up to date, after undo it's rebuilt when mark() needs it.
+RegionIndex maskRegions;
+
+inline RegionIndex& currentMaskRegions() {
+    if (maskRegions.empty() && !curMask.empty()) {
+        maskRegions.build(curMask);
+    }
+    return maskRegions;
+}
 
-const CvScalar buildingsColor = CV_RGB(96, 96, 96);
+// edits of markerMask and curMask, see EditHistory
+EditHistory history;
 
-const CvScalar waterColor = CV_RGB(0, 128, 255);
+// per label counters of maskRegions kept with edits of curMask,
+// so statistics are right after undo without rebuilding maskRegions
+struct MaskCounts : public EditState {
+    std::vector<size_t> pixels;
+    std::vector<int> regions;
+};
 
-const CvScalar cloudsColor = CV_RGB(224, 224, 224);
+// counters of curMask brought back by undo / redo while maskRegions is dropped
+std::shared_ptr<const MaskCounts> restoredCounts;
 
-const CvScalar unknownColor = CV_RGB(0, 0, 0);
+EditStatePtr countsOf(const RegionIndex& regions) {
+    std::shared_ptr<MaskCounts> counts = std::make_shared<MaskCounts>();
+    counts->pixels = regions.labelPixels();
+    counts->regions = regions.labelRegions();
+    return counts;
+}
+
+// empty if they aren't known without rebuilding maskRegions
+inline EditStatePtr maskCounts() {
+    return maskRegions.empty() ? restoredCounts : countsOf(maskRegions);
+}
 
-const CvScalar notSpecifiedColor = CV_RGB(255, 0, 0);
+inline ClassStats maskClassStats() {
+    if (maskRegions.empty() && restoredCounts) {
+        return classStats(restoredCounts->pixels, restoredCounts->regions);
+    }
+    return classStats(currentMaskRegions());
+}
 
 const string IMAGE_WINDOW_NAME("image");
 const string WATERSHED_TRANS_WINDOW_NAME("watershed transform");
 const string MASK_WINDOW_NAME("mask");
 
-void initColorSet(unordered_set<CvScalar>& colors) {
-    colors.insert(justTerrainColor);
-    colors.insert(snowColor);
-    colors.insert(sandColor);
-    colors.insert(forestColor);
-    colors.insert(grassColor);
-    colors.insert(roadsColor);
-    colors.insert(waterColor);
-    colors.insert(buildingsColor);
-    colors.insert(cloudsColor);
-    colors.insert(unknownColor);
+void mark(Mat& labels, Point seed, uchar label=notSpecifiedLabel)
+{
+    currentMaskRegions();
+    history.begin("fill", maskCounts());
+    history.touch(labels, maskRegions.regionRect(seed));
+    maskRegions.fill(labels, seed, label);
+    history.commit(maskCounts());
 }
 
-void mark(Mat src_, CvPoint seed, CvScalar color=CV_RGB(255, 0, 0))
-{
-    IplImage* src = new IplImage(src_);
-    CvConnectedComp comp;
-
-    cvFloodFill( src, seed, color,
-                 cvScalarAll(10), // минимальная разность
-                 cvScalarAll(10), // максимальная разность
-                 &comp,
-                 CV_FLOODFILL_FIXED_RANGE + 8,
-                 0);
+inline void showMask() {
+    colorizeLabels(curMask, curMaskColors);
+    imshow(MASK_WINDOW_NAME, curMaskColors);
 }
 
+const Vec3b MARKERS_COLOR = cvScalar2Vec3b(CV_RGB(255, 0, 0));
+
+// full redraw, for when the whole marker set is replaced
 inline void refreshMainImg() {
-    img0.copyTo(img);
+    TRACE_SCOPE("refresh");
+    overlayMarkers(img0, markerMask, img, MARKERS_COLOR);
+    overlayDirty = Rect();
 
-    for (size_t i = 0 ; i < img.cols; ++i) {
-        for (size_t j = 0; j < img.rows; ++j) {
-            if (markerMask.at<uchar>(j, i) == 255) {
-                img.at<Vec3b>(j, i) = cvScalar2Vec3b(CV_RGB(255, 0, 0));
-            }
-        }
+    imshow( IMAGE_WINDOW_NAME, img );
+}
+
+// recomposites only what strokes changed since the last redraw
+inline void redrawDirtyMarkers() {
+    TRACE_SCOPE("refresh/dirty");
+    if (overlayDirty.area() > 0) {
+        overlayMarkers(img0, markerMask, img, MARKERS_COLOR, overlayDirty);
+        overlayDirty = Rect();
     }
 
     imshow( IMAGE_WINDOW_NAME, img );
@@ -106,21 +205,53 @@ inline int blackBrushThickness(int redBrushThickness) {
     return redBrushThickness * redBrushThickness;
 }
 
+// area line() of the given thickness can change
+inline Rect lineRect(Point from, Point to, int thickness) {
+    int r = thickness / 2 + 1;
+    return Rect(Point(std::min(from.x, to.x) - r, std::min(from.y, to.y) - r),
+                Point(std::max(from.x, to.x) + r + 1, std::max(from.y, to.y) + r + 1));
+}
+
+inline void markMarkersDirty(const Rect& rect) {
+    markersDirty = markersDirty.area() > 0 ? (markersDirty | rect) : rect;
+    overlayDirty = overlayDirty.area() > 0 ? (overlayDirty | rect) : rect;
+}
+
+inline void markLineDirty(Point from, Point to, int thickness) {
+    markMarkersDirty(lineRect(from, to, thickness));
+}
+
+// strokes of markers are recorded by history before they are drawn
+inline void drawMarkersLine(Point from, Point to, uchar value, int thickness) {
+    history.touch(markerMask, lineRect(from, to, thickness));
+    line( markerMask, from, to, Scalar::all(value), thickness, 8, 0 );
+    markLineDirty(from, to, thickness);
+}
+
 static void onMouse( int event, int x, int y, int flags, void* )
 {
+    // a stroke can end outside the image, it's finished all the same
+    if( event == EVENT_RBUTTONUP ) {
+        history.commit();
+        redrawDirtyMarkers();
+        prevPt = Point(-1,-1);
+        return;
+    }
+
     if( x < 0 || x >= img.cols || y < 0 || y >= img.rows ) {
         return;
     }
 
     if( event == EVENT_RBUTTONDOWN ) {
         prevPt = Point(x,y);
+        history.begin("stroke");
     }
     else if( event == EVENT_MOUSEMOVE && (flags & EVENT_FLAG_RBUTTON) && !(flags & EVENT_FLAG_CTRLKEY) )
     {
         Point pt(x, y);
         if( prevPt.x < 0 )
             prevPt = pt;
-        line( markerMask, prevPt, pt, Scalar::all(255), curThickness, 8, 0 );
+        drawMarkersLine(prevPt, pt, 255, curThickness);
         line( img, prevPt, pt, Scalar(0, 0, 255), curThickness, 8, 0 );
         prevPt = pt;
         imshow(IMAGE_WINDOW_NAME, img);
@@ -130,14 +261,11 @@ static void onMouse( int event, int x, int y, int flags, void* )
         Point pt(x, y);
         if( prevPt.x < 0 )
             prevPt = pt;
-        line( markerMask, prevPt, pt, Scalar::all(0), blackBrushThickness(curThickness), 8, 0 );
+        drawMarkersLine(prevPt, pt, 0, blackBrushThickness(curThickness));
         line( img, prevPt, pt, Scalar::all(0), blackBrushThickness(curThickness), 8, 0 );
         prevPt = pt;
         imshow(IMAGE_WINDOW_NAME, img);
     } else {
-        if (event == EVENT_RBUTTONUP /*&& (flags & EVENT_FLAG_CTRLKEY)*/) { // uncomment for speeding up
-            refreshMainImg();
-        }
         prevPt = Point(-1,-1);
     }
 }
@@ -148,8 +276,12 @@ static void onMouse_Mask( int event, int x, int y, int flags, void* ) {
         break;
 
     case CV_EVENT_RBUTTONDOWN:
-        mark(curMask, cvPoint(x, y), curColor);
-        imshow(MASK_WINDOW_NAME, curMask);
+        if( x < 0 || x >= curMask.cols || y < 0 || y >= curMask.rows ) {
+            break;
+        }
+        jobs.cancel();
+        mark(curMask, Point(x, y), curLabel);
+        showMask();
         break;
 
     case CV_EVENT_RBUTTONUP:
@@ -157,32 +289,6 @@ static void onMouse_Mask( int event, int x, int y, int flags, void* ) {
     }
 }
 
-inline bool file_exists(const string& name) {
-    return ( access( name.c_str(), F_OK ) != -1 );
-}
-
-inline string removeExtention(const string& filename) {
-    const std::string ext(".jpg");
-    if ( filename != ext &&
-         filename.size() > ext.size() &&
-         filename.substr(filename.size() - ext.size()) == ".jpg" )
-    {
-        return filename.substr(0, filename.size() - ext.size());
-    }
-
-    cerr << "Can't remove extention" << endl;
-    return "";
-}
-
-inline string genMaskFileName(const string& filename) {
-    string pureFilename = removeExtention(filename);
-    if (pureFilename.empty()) {
-        return "";
-    }
-
-    return pureFilename + "_mask.png";
-}
-
 inline void saveMask(const string& maskFilename) {
     if (!(curMask.rows > 0 && curMask.cols > 0)) {
         cerr << "No mask to save" << endl;
@@ -207,8 +313,31 @@ inline void saveMask(const string& maskFilename) {
         //            }
         //        }
 
-        cout << "Saving mask to " << maskFilename << endl;
-        imwrite(maskFilename, curMask);
+        TRACE_SCOPE("save/mask");
+        const Mat mask = toImageResolution(curMask);
+        if (useLabelFiles) {
+            const string filename = labelFileName(maskFilename);
+            cout << "Saving mask to " << filename << endl;
+            if (!writeLabelFile(filename, mask, true)) {
+                return;
+            }
+        } else {
+            cout << "Saving mask to " << maskFilename << endl;
+            Mat maskColors;
+            colorizeLabels(mask, maskColors);
+            imwrite(maskFilename, maskColors);
+        }
+
+        // counters of the view don't give areas of the image
+        RegionIndex imageRegions;
+        if (viewFactor > 1) {
+            imageRegions.build(mask);
+        }
+        const ClassStats stats = viewFactor > 1 ? classStats(imageRegions) : maskClassStats();
+        if (!writeClassStatsCsv(classStatsFileName(maskFilename, "csv"), stats) ||
+            !writeClassStatsJson(classStatsFileName(maskFilename, "json"), stats)) {
+            return;
+        }
         cout << "Saved successfully!" << endl;
     } else {
         cerr << "Something went wrong, can't generate name for mask" << endl;
@@ -225,29 +354,43 @@ inline void createMaskWindow() {
 }
 
 inline void loadMask(const string& maskFileName) {
-    if (!file_exists(maskFileName)) {
+    // the file of --format, the other one if there is only that
+    const string fileName = pickLabelsFile(maskFileName, useLabelFiles);
+    if (fileName.empty()) {
         cerr << "No mask file to load!" << endl;
         return;
     }
+    const bool isLabels = fileName != maskFileName;
 
-    cout << "Loading mask..." << endl;
+    cout << "Loading mask from " << fileName << "..." << endl;
+    TRACE_SCOPE("load/mask");
+
+    Mat labels;
+    if (isLabels) {
+        labels = readLabelFile(fileName);
+    } else {
+        Mat maskColors = imread(fileName, 1);
+        if (!maskColors.empty() && !labelsFromColors(maskColors, labels)) {
+            cerr << fileName << " has a region touching regions of all region labels" << endl;
+        }
+    }
+    if (labels.empty() || labels.size() != imageSize) {
+        cerr << "Can't read mask file " << fileName << endl;
+        return;
+    }
+    labels = toViewResolution(labels);
 
     createMaskWindow();
-    curMask = imread(maskFileName, 1);
-    imshow(MASK_WINDOW_NAME, curMask);
+    jobs.cancel();
+    RegionIndex regions;
+    regions.build(labels);
+    history.replace(curMask, labels, "load mask", maskCounts(), countsOf(regions));
+    std::swap(maskRegions, regions);
+    showMask();
 
     cout << "Done!" << endl;
 }
 
-inline string genMarkersFileName(const string& filename) {
-    string pureFilename = removeExtention(filename);
-    if (pureFilename.empty()) {
-        return "";
-    }
-
-    return pureFilename + "_zMarkers.png";
-}
-
 inline void saveMarkers(const string& filename) {
     if (!(markerMask.rows > 0 && markerMask.cols > 0)) {
         cerr << "No markers to save" << endl;
@@ -256,8 +399,16 @@ inline void saveMarkers(const string& filename) {
 
     if ( !filename.empty() )
     {
-        cout << "Saving markers to " << filename << endl;
-        imwrite(filename, markerMask);
+        TRACE_SCOPE("save/markers");
+        if (useLabelFiles) {
+            cout << "Saving markers to " << labelFileName(filename) << endl;
+            if (!writeLabelFile(labelFileName(filename), toImageResolution(markerMask), false)) {
+                return;
+            }
+        } else {
+            cout << "Saving markers to " << filename << endl;
+            imwrite(filename, toImageResolution(markerMask));
+        }
         cout << "Saved successfully!" << endl;
     } else {
         cerr << "Something went wrong, can't generate name for markers" << endl;
@@ -265,46 +416,193 @@ inline void saveMarkers(const string& filename) {
 }
 
 inline void loadMarkers(const string& filename) {
-    if (!file_exists(filename)) {
+    const string fileName = pickLabelsFile(filename, useLabelFiles);
+    if (fileName.empty()) {
         cerr << "No markers file to load!" << endl;
         return;
     }
+    const bool isLabels = fileName != filename;
 
-    cout << "Loading markers..." << endl;
+    cout << "Loading markers from " << fileName << "..." << endl;
+    TRACE_SCOPE("load/markers");
 
-    markerMask = imread(filename, 1);
-    cvtColor(markerMask, markerMask, CV_RGB2GRAY);
+    Mat markers = isLabels ? readLabelFile(fileName) : imread(fileName, IMREAD_GRAYSCALE);
+    if (markers.empty() || markers.size() != imageSize) {
+        cerr << "Can't read markers file " << fileName << endl;
+        return;
+    }
+    markers = toViewResolution(markers);
+    jobs.cancel();
+    history.replace(markerMask, markers, "load markers");
+    segmenter.reset();
     refreshMainImg();
 
     cout << "Done!" << endl;
 }
 
-void mergeMasks(Mat& src, const Mat& dst) {
-    if (src.rows != dst.rows || src.cols != dst.cols) {
-        cerr << "Can't merge masks, incompatible sizes" << endl;
+// Undoes or redoes the last edit, for markers the next watershed run recomputes only the restored area
+void undoEdit(bool redo) {
+    jobs.cancel();
+    std::vector<EditHistory::Change> changes;
+    string name;
+    EditStatePtr state;
+    if (!(redo ? history.redo(changes, name, state) : history.undo(changes, name, state))) {
+        cout << "Nothing to " << (redo ? "redo" : "undo") << endl;
         return;
     }
-
-    for (size_t i = 0; i < src.rows; ++i) {
-        for (size_t j = 0; j < dst.cols; ++j) {
-            if (src.at<Vec3b>(i, j) == cvScalar2Vec3b(notSpecifiedColor)) {
-                src.at<Vec3b>(i, j) = dst.at<Vec3b>(i, j);
-            }
+    cout << (redo ? "Redo " : "Undo ") << name << endl;
+
+    for (size_t k = 0; k < changes.size(); ++k) {
+        if (changes[k].layer == &markerMask) {
+            markMarkersDirty(changes[k].rect);
+            redrawDirtyMarkers();
+        } else if (changes[k].layer == &curMask) {
+            // maskRegions can't follow, but the counters are known for every state of curMask
+            restoredCounts = std::dynamic_pointer_cast<const MaskCounts>(state);
+            maskRegions.clear();
+            showMask();
         }
     }
 }
 
+WatershedEngine parseWatershedEngine(const string& name)
+{
+    if (name == "parallel")
+        return PARALLEL_WATERSHED;
+    if (name == "pyramid")
+        return PYRAMID_WATERSHED;
+    return OPENCV_WATERSHED;
+}
+
+const char* watershedEngineName(WatershedEngine engine)
+{
+    switch (engine) {
+    case PARALLEL_WATERSHED:
+        return "parallel";
+    case PYRAMID_WATERSHED:
+        return "pyramid";
+    default:
+        return "opencv";
+    }
+}
+
+WatershedOptions parseWatershedOptions(const cv::CommandLineParser& parser)
+{
+    WatershedOptions options(parseWatershedEngine(parser.get<string>("watershed")));
+    options.validate = parser.has("validate");
+    options.pyramidLevels = parser.get<int>("pyramid_levels");
+    options.pyramidBand = parser.get<int>("pyramid_band");
+    options.resolveBoundaries = parser.has("resolve_boundaries");
+    return options;
+}
+
+PipelineOptions parsePipelineOptions(const cv::CommandLineParser& parser)
+{
+    PipelineOptions options;
+    options.watershed = parseWatershedOptions(parser);
+    options.filterWinSize = parser.get<int>("winsize");
+    options.filterMode = parser.get<string>("filter") == "sliding" ? SLIDING_FILTER : BLOCK_FILTER;
+    options.tiled = parser.has("tiled");
+    options.tiles.tileSize = parser.get<int>("tile");
+    options.tiles.halo = parser.get<int>("halo");
+    options.tiles.memoryBudgetMB = parser.get<int>("tile_budget");
+    options.tiles.validate = parser.has("validate_tiles");
+    return options;
+}
+
 int main( int argc, char** argv )
 {
-    cv::CommandLineParser parser(argc, argv, "{help h | | }{ @input | ../data/fruits.jpg | }");
+    cv::CommandLineParser parser(argc, argv,
+                                 "{help h | | }{ @input | ../data/fruits.jpg | }"
+                                 "{batch b | | }{threads j | 0 | }{winsize | 10 | }{filter | block | }"
+                                 "{tiled | | }{tile | 0 | }{halo | 64 | }{tile_budget | 1024 | }{validate_tiles | | }"
+                                 "{watershed | opencv | }{validate | | }{pyramid_levels | 2 | }{pyramid_band | 4 | }"
+                                 "{resolve_boundaries | | }"
+                                 "{format | png | }{convert | | }{trace | | }{history_mb | 256 | }"
+                                 "{serve | | }{queue | 64 | }{batch_max | 8 | }{small_mb | 4 | }"
+                                 "{export | | }{export_dir | | }{export_tile | 256 | }{export_stride | 0 | }"
+                                 "{max_ignored | 0.5 | }{min_classes | 1 | }{min_class_fraction | 0.05 | }");
     if (parser.has("help"))
     {
         help();
         return 0;
     }
+
+    if (parser.has("convert"))
+    {
+        const string input = parser.get<string>("convert");
+        const string png(".png");
+        const bool toLabels = input.size() > png.size() && input.substr(input.size() - png.size()) == png;
+        const string output = toLabels ? labelFileName(input) : input.substr(0, input.rfind('.')) + png;
+        if (!(toLabels ? pngToLabelFile(input, output) : labelFileToPng(input, output))) {
+            return 1;
+        }
+        cout << "Converted " << input << " to " << output << endl;
+        return 0;
+    }
+
+    useLabelFiles = parser.get<string>("format") == "lbl";
+
+    if (parser.has("serve"))
+    {
+        ServiceOptions options;
+        options.socketPath = parser.get<string>("serve");
+        options.workers = parser.get<int>("threads");
+        const int maxQueue = parser.get<int>("queue");
+        if (maxQueue < 1)
+        {
+            cerr << "--queue has to be at least 1" << endl;
+            return 1;
+        }
+        options.maxQueue = maxQueue;
+        options.maxBatch = parser.get<int>("batch_max");
+        options.smallBytes = (size_t)parser.get<int>("small_mb") << 20;
+        options.pipeline = parsePipelineOptions(parser);
+        return runService(options);
+    }
+
+    if (parser.has("export"))
+    {
+        TileExportOptions options;
+        options.input = parser.get<string>("export");
+        options.outputDir = parser.get<string>("export_dir");
+        options.tileSize = parser.get<int>("export_tile");
+        options.stride = parser.get<int>("export_stride");
+        options.maxIgnoredFraction = parser.get<double>("max_ignored");
+        options.minClasses = parser.get<int>("min_classes");
+        options.minClassFraction = parser.get<double>("min_class_fraction");
+        options.threads = parser.get<int>("threads");
+        options.labelFiles = useLabelFiles;
+        return runTileExport(options);
+    }
+
+    if (parser.has("batch"))
+    {
+        BatchOptions options;
+        options.input = parser.get<string>("batch");
+        options.threads = parser.get<int>("threads");
+        options.pipeline = parsePipelineOptions(parser);
+        options.tracePath = parser.get<string>("trace");
+        options.labelFiles = useLabelFiles;
+        return runBatch(options);
+    }
     string filename = parser.get<string>("@input");
-    img0 = imread(filename, 1);
-    Mat imgGray;
+    wshedOptions = parseWatershedOptions(parser);
+    history = EditHistory((size_t)parser.get<int>("history_mb") << 20);
+    const string tracePath = parser.get<string>("trace");
+    enableTracing(!tracePath.empty());
+    {
+        TRACE_SCOPE("load/image");
+        // read by tiles where the format allows, see openImageSource
+        Ptr<ImageSource> source = openImageSource(filename, IMREAD_COLOR);
+        imageSize = source ? source->size() : Size();
+        if (imageSize.area() > 0) {
+            const double budget = wholeImagePixelBudget(parsePipelineOptions(parser).tiles);
+            viewFactor = std::max(1, (int)std::ceil(std::sqrt((double)imageSize.width * imageSize.height / budget)));
+            img0 = readDownsampled(*source, viewFactor);
+        }
+    }
+    Mat imgGray, wshed;
 
     if( img0.empty() )
     {
@@ -312,15 +610,19 @@ int main( int argc, char** argv )
         return 0;
     }
     help();
+    if (viewFactor > 1) {
+        cout << "The image is over the tile budget, it's edited at 1/" << viewFactor << " of its size ("
+             << img0.cols << "x" << img0.rows << "), markers and mask are saved at full size" << endl;
+    }
 
-    unordered_set<CvScalar> validColors;
-    initColorSet(validColors);
+    LabelSet validLabels;
+    initLabelSet(validLabels);
 
     namedWindow( IMAGE_WINDOW_NAME, WINDOW_NORMAL | CV_GUI_NORMAL);
 
     img0.copyTo(img);
-    cvtColor(img, markerMask, COLOR_BGR2GRAY);
-    cvtColor(markerMask, imgGray, COLOR_GRAY2BGR);
+    cvtColor(img, imgGray, COLOR_BGR2GRAY);
+    markerMask.create(img.size(), CV_8U);
     markerMask = Scalar::all(0);
     imshow( IMAGE_WINDOW_NAME, img );
     resizeWindow(IMAGE_WINDOW_NAME, IMG_WIDTH, IMG_HEIGHT);
@@ -329,9 +631,23 @@ int main( int argc, char** argv )
     bool isColorSelectMode = false;
     for(;;)
     {
-        char c = (char)waitKey(0);
+        // block while idle, keep polling while a job runs
+        int key = waitKey(jobs.busy() ? JOB_POLL_MS : 0);
+        jobs.poll();
+        if (key < 0) {
+            continue;
+        }
+        char c = (char)key;
 
         if( c == 27 ) {
+            // jobs refer to locals of main, they have to be done before it returns
+            jobs.shutdown();
+            if (!tracePath.empty()) {
+                printTraceSummary(cout);
+                if (!writeChromeTrace(tracePath)) {
+                    cerr << "Can't write trace " << tracePath << endl;
+                }
+            }
             break;
         }
 
@@ -369,18 +685,39 @@ int main( int argc, char** argv )
             loadMarkers(genMarkersFileName(filename)) ;
             break;
         case ' ': {
-            Mat wshed = runWatershed(img0, markerMask);
-
-            if (wshed.empty()) {
-                break;
-            }
-
-            curMask = wshed.clone();
-            wshed = wshed*0.5 + imgGray*0.5;
-
-            namedWindow( WATERSHED_TRANS_WINDOW_NAME, cv::WINDOW_NORMAL | CV_GUI_NORMAL);
-            imshow( WATERSHED_TRANS_WINDOW_NAME, wshed );
-            resizeWindow(WATERSHED_TRANS_WINDOW_NAME, IMG_WIDTH, IMG_HEIGHT);
+            // markers can change while the job runs, it works on their snapshot.
+            // The segmenter goes with the job and comes back with its result (or is dropped with it,
+            // then the next run is a full one).
+            std::shared_ptr<WatershedJob> job = std::make_shared<WatershedJob>();
+            job->markers = markerMask.clone();
+            job->dirty = markersDirty;
+            std::swap(job->segmenter, segmenter);
+            job->segmenter.options().watershed = wshedOptions;
+            markersDirty = Rect();
+
+            const Mat gray = imgGray;
+            jobs.start("Watershed", [job, gray](JobContext& context) {
+                if (!job->segmenter.watershed(img0, job->markers, job->dirty) || context.cancelled()) {
+                    return false;
+                }
+                context.setProgress(0.7);
+                job->segmenter.render(gray, job->mask, job->preview);
+                if (context.cancelled()) {
+                    return false;
+                }
+                context.setProgress(0.85);
+                job->regions.build(job->mask);
+                return true;
+            }, [job, &wshed]() {
+                std::swap(segmenter, job->segmenter);
+                history.replace(curMask, job->mask, "watershed", maskCounts(), countsOf(job->regions));
+                std::swap(maskRegions, job->regions);
+                std::swap(wshed, job->preview);
+
+                namedWindow( WATERSHED_TRANS_WINDOW_NAME, cv::WINDOW_NORMAL | CV_GUI_NORMAL);
+                imshow( WATERSHED_TRANS_WINDOW_NAME, wshed );
+                resizeWindow(WATERSHED_TRANS_WINDOW_NAME, IMG_WIDTH, IMG_HEIGHT);
+            });
             break;
         }
         case 13: { // Enter
@@ -389,10 +726,33 @@ int main( int argc, char** argv )
                 break;
             }
 
-            Mat dst = runThresholdBasedMethod(img0);
-
-            mergeMasks(curMask, dst);
-            imshow(MASK_WINDOW_NAME, curMask);
+            // back buffer, curMask stays on screen until the result is ready
+            std::shared_ptr<Mat> mask = std::make_shared<Mat>(curMask.clone());
+            std::shared_ptr<string> report = std::make_shared<string>();
+            std::shared_ptr<RegionIndex> regions = std::make_shared<RegionIndex>();
+            jobs.start("Threshold merge", [mask, report, regions](JobContext& context) {
+                Mat dst = runThresholdBasedMethod(img0);
+                if (context.cancelled()) {
+                    return false;
+                }
+                context.setProgress(0.6);
+                std::vector<MergeSource> sources;
+                sources.push_back(MergeSource(*mask, "mask"));
+                sources.push_back(MergeSource(dst, "threshold"));
+                std::vector<size_t> contributed = mergeMasks(sources, *mask);
+                *report = mergeReport(sources, contributed);
+                if (context.cancelled()) {
+                    return false;
+                }
+                context.setProgress(0.8);
+                regions->build(*mask);
+                return true;
+            }, [mask, report, regions]() {
+                cout << *report << endl;
+                history.replace(curMask, *mask, "threshold merge", maskCounts(), countsOf(*regions));
+                std::swap(maskRegions, *regions);
+                showMask();
+            });
             break;
         }
         case 's':
@@ -401,7 +761,7 @@ int main( int argc, char** argv )
                 continue;
             }
             createMaskWindow();
-            imshow(MASK_WINDOW_NAME, curMask);
+            showMask();
             break;
         case 'f':
             if (curMask.empty()) {
@@ -410,16 +770,65 @@ int main( int argc, char** argv )
             }
 
             cout << "Applying filter to mask" << endl;
-            // TODO: speed it up and do it in separate thread
-            invalidColorFilter( curMask, validColors );
-            cout << "done!" << endl;
-            imshow(MASK_WINDOW_NAME, curMask);
+            {
+                std::shared_ptr<Mat> mask = std::make_shared<Mat>(curMask.clone());
+                std::shared_ptr<FilterStats> stats = std::make_shared<FilterStats>();
+                std::shared_ptr<RegionIndex> regions = std::make_shared<RegionIndex>();
+                jobs.start("Filter", [mask, stats, regions, validLabels](JobContext& context) {
+                    *stats = invalidColorFilter( *mask, validLabels, DEFAULT_FILTER_WIN_SIZE, &context );
+                    if (context.cancelled()) {
+                        return false;
+                    }
+                    regions->build(*mask);
+                    return true;
+                }, [mask, stats, regions]() {
+                    history.replace(curMask, *mask, "filter", maskCounts(), countsOf(*regions));
+                    std::swap(maskRegions, *regions);
+                    cout << "done! " << stats->replacedPixels << " pixels replaced, "
+                         << stats->emptyWindows << " of " << stats->windows
+                         << " windows had no valid colors and were skipped" << endl;
+                    showMask();
+                });
+            }
+            break;
+        case 'F':
+            if (curMask.empty()) {
+                cerr << "Mask is not created yet!" << endl;
+                continue;
+            }
+
+            cout << "Applying sliding window filter to mask" << endl;
+            {
+                std::shared_ptr<Mat> mask = std::make_shared<Mat>(curMask.clone());
+                std::shared_ptr<FilterStats> stats = std::make_shared<FilterStats>();
+                std::shared_ptr<RegionIndex> regions = std::make_shared<RegionIndex>();
+                jobs.start("Sliding filter", [mask, stats, regions, validLabels](JobContext& context) {
+                    *stats = slidingModeFilter( *mask, validLabels, DEFAULT_FILTER_RADIUS, &context );
+                    if (context.cancelled()) {
+                        return false;
+                    }
+                    regions->build(*mask);
+                    return true;
+                }, [mask, stats, regions]() {
+                    history.replace(curMask, *mask, "sliding filter", maskCounts(), countsOf(*regions));
+                    std::swap(maskRegions, *regions);
+                    cout << "done! " << stats->replacedPixels << " pixels replaced, "
+                         << stats->emptyWindows << " pixels had no valid colors around and were skipped" << endl;
+                    showMask();
+                });
+            }
             break;
         default :
             if (!isColorSelectMode) {
                 if( c == 'r' )
                 {
+                    jobs.cancel();
+                    history.begin("clear markers");
+                    history.touch(markerMask, Rect(0, 0, markerMask.cols, markerMask.rows));
                     markerMask = Scalar::all(0);
+                    history.commit();
+                    segmenter.reset();
+                    overlayDirty = Rect();
                     img0.copyTo(img);
                     imshow( IMAGE_WINDOW_NAME, img );
                     cout << "Main image and markers has been cleared" << endl;
@@ -430,77 +839,114 @@ int main( int argc, char** argv )
                 } else if (c == 'h') {
                     refreshMainImg();
                     cout << "Main image has been refreshed!" << endl;
+                } else if (c == 'c') {
+                    jobs.cancel();
+                } else if (c == 'i') {
+                    if (curMask.empty()) {
+                        cerr << "Mask is not created yet!" << endl;
+                    } else {
+                        cout << classStatsTable(maskClassStats()) << endl;
+                    }
+                } else if (c == 'u' || c == 'y') {
+                    undoEdit(c == 'y');
+                } else if (c == 'p') {
+                    wshedOptions.engine = WatershedEngine((wshedOptions.engine + 1) % (PYRAMID_WATERSHED + 1));
+                    cout << "Watershed engine: " << watershedEngineName(wshedOptions.engine) << endl;
+                } else if (c == 'v') {
+                    wshedOptions.validate = !wshedOptions.validate;
+                    cout << "Watershed validation " << (wshedOptions.validate ? "on" : "off") << endl;
+                } else if (c == 'b') {
+                    wshedOptions.resolveBoundaries = !wshedOptions.resolveBoundaries;
+                    // boundaries of the kept result are either all there or all resolved
+                    jobs.cancel();
+                    segmenter.reset();
+                    cout << "Assigning watershed boundaries to regions "
+                         << (wshedOptions.resolveBoundaries ? "on" : "off") << endl;
                 }
             } else {
-                vector<Vec3b> from, to = {cvScalar2Vec3b(curColor)};
+                vector<uchar> from, to = {curLabel};
                 switch (c) {
                 case 't':
                     cout << "Selecting brown color(just terrain)" << endl;
-                    curColor = justTerrainColor;
+                    curLabel = justTerrainLabel;
                     break;
                 case 'w':
                     cout << "Selecting light-blue color(snow)" << endl;
-                    curColor = snowColor;
+                    curLabel = snowLabel;
                     break;
                 case 'y':
                     cout << "Selecting yellow color(sand)" << endl;
-                    curColor = sandColor;
+                    curLabel = sandLabel;
                     break;
                 case 'g':
                     cout << "Selecting dark-green color(forest)" << endl;
-                    curColor = forestColor;
+                    curLabel = forestLabel;
                     break;
                 case 'p':
                     cout << "Selecting light-green color(grass)" << endl;
-                    curColor = grassColor;
+                    curLabel = grassLabel;
                     break;
 
                 case 'r':
                     cout << "Selecting gray color(roads)" << endl;
-                    curColor = roadsColor;
+                    curLabel = roadsLabel;
                     break;
 
                 case 'd':
                     cout << "Selecting dark-gray color(buildings)" << endl;
-                    curColor = buildingsColor;
+                    curLabel = buildingsLabel;
                     break;
 
                 case 'b':
                     cout << "Selecting blue color(water)" << endl;
-                    curColor = waterColor;
+                    curLabel = waterLabel;
                     break;
 
                 case 'c':
                     cout << "Selecting light-gray color(clouds)" << endl;
-                    curColor = cloudsColor;
+                    curLabel = cloudsLabel;
                     break;
 
                 case 'x':
                     cout << "Selecting red color(not specified)" << endl;
-                    curColor = notSpecifiedColor;
+                    curLabel = notSpecifiedLabel;
                     break;
 
                 case 'u':
                     cout << "Selecting black color(unknown)" << endl;
-                    curColor = unknownColor;
+                    curLabel = unknownLabel;
                     break;
 
                 case '-':
                     cout << "Replacing violet color with selected color" << endl;
 
-                    from = {Vec3b(255, 0, 255)};
-                    recolorImg(curMask, {Vec3b(255, 0, 255)}, to);
-
-                    imshow(MASK_WINDOW_NAME, curMask);
+                    from = {thresholdLowLabel};
+                    jobs.cancel();
+                    // relabeling goes over the whole mask anyway, the index can be rebuilt if it's dropped
+                    currentMaskRegions();
+                    history.begin("replace color", maskCounts());
+                    history.touch(curMask, Rect(0, 0, curMask.cols, curMask.rows));
+                    relabelImg(curMask, from, to);
+                    maskRegions.relabel(thresholdLowLabel, curLabel);
+                    history.commit(maskCounts());
+
+                    showMask();
                     break;
 
                 case '=':
                     cout << "Replacing cyan color with selected color" << endl;
 
-                    from = {Vec3b(255, 255, 0)};
-                    recolorImg(curMask, from, to);
-
-                    imshow(MASK_WINDOW_NAME, curMask);
+                    from = {thresholdHighLabel};
+                    jobs.cancel();
+                    // relabeling goes over the whole mask anyway, the index can be rebuilt if it's dropped
+                    currentMaskRegions();
+                    history.begin("replace color", maskCounts());
+                    history.touch(curMask, Rect(0, 0, curMask.cols, curMask.rows));
+                    relabelImg(curMask, from, to);
+                    maskRegions.relabel(thresholdHighLabel, curLabel);
+                    history.commit(maskCounts());
+
+                    showMask();
                     break;
 
                 case 9: // tab
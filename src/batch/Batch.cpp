@@ -0,0 +1,237 @@
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <dirent.h>
+
+#include "Batch.h"
+#include "Palette.h"
+#include "FileUtils.h"
+#include "ImageSource.h"
+#include "LabelFile.h"
+#include "Segmenter.h"
+#include "Trace.h"
+
+namespace {
+
+struct BatchResult {
+    BatchResult() : ok(false), megapixels(0) {}
+
+    bool ok;
+    double megapixels;
+};
+
+bool hasImageExtention(const std::string& name) {
+    return !removeExtention(name, false).empty();
+}
+
+BatchResult processImage(const std::string& filename, const BatchOptions& batchOptions,
+                         std::mutex& logMutex) {
+    const PipelineOptions& options = batchOptions.pipeline;
+    TRACE_SCOPE("batch/image");
+    BatchResult result;
+
+    std::string maskFilename = genMaskFileName(filename);
+    std::string markersFilename = genMarkersFileName(filename);
+    if (maskFilename.empty() || markersFilename.empty()) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cerr << filename << ": can't generate output names, skipping" << std::endl;
+        return result;
+    }
+
+    // images are read by tiles when possible, see ImageSource
+    cv::Ptr<ImageSource> image = openImageSource(filename, cv::IMREAD_COLOR);
+    const cv::Size imageSize = image->size();
+    if (imageSize.area() == 0) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cerr << filename << ": can't open image, skipping" << std::endl;
+        return result;
+    }
+
+    // markers of the chosen format, or the other one if there is only that
+    // (label files are memory mapped and decoded tile by tile)
+    markersFilename = pickLabelsFile(markersFilename, batchOptions.labelFiles);
+    if (batchOptions.labelFiles) {
+        maskFilename = labelFileName(maskFilename);
+    }
+
+    cv::Ptr<ImageSource> markers;
+    if (!markersFilename.empty()) {
+        markers = openImageSource(markersFilename, cv::IMREAD_GRAYSCALE);
+    }
+    if (!markers || markers->size() != imageSize) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cerr << filename << ": no markers file or markers don't match image size, skipping" << std::endl;
+        return result;
+    }
+
+    Segmenter segmenter(options);
+    cv::Mat mask;
+    if (options.tiled) {
+        segmenter.segment(*image, *markers, mask);
+    } else {
+        const cv::Rect imageRect(0, 0, imageSize.width, imageSize.height);
+        cv::Mat img0, markerMask;
+        {
+            TRACE_SCOPE("load/image");
+            img0 = image->read(imageRect);
+            markerMask = markers->read(imageRect);
+        }
+        segmenter.segment(img0, markerMask, mask);
+    }
+    image.release();
+    markers.release();
+
+    if (mask.empty()) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cerr << filename << ": markers are empty, skipping" << std::endl;
+        return result;
+    }
+
+    TRACE_SCOPE("save/mask");
+    bool saved = false;
+    if (batchOptions.labelFiles) {
+        saved = writeLabelFile(maskFilename, mask, true);
+    } else {
+        cv::Mat maskColors;
+        colorizeLabels(mask, maskColors);
+        saved = cv::imwrite(maskFilename, maskColors);
+    }
+    if (!saved) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cerr << filename << ": can't write " << maskFilename << std::endl;
+        return result;
+    }
+
+    result.ok = true;
+    result.megapixels = imageSize.area() / 1e6;
+
+    std::lock_guard<std::mutex> lock(logMutex);
+    std::cout << "Saved " << maskFilename << " (markers from " << markersFilename << ")" << std::endl;
+    return result;
+}
+
+} // namespace
+
+bool collectImages(const std::string& input, std::vector<std::string>& images) {
+    if (is_directory(input)) {
+        DIR* dir = opendir(input.c_str());
+        if (!dir) {
+            std::cerr << "Can't open directory " << input << std::endl;
+            return false;
+        }
+
+        const std::string prefix = input[input.size() - 1] == '/' ? input : input + "/";
+        for (dirent* entry = readdir(dir); entry; entry = readdir(dir)) {
+            std::string name(entry->d_name);
+            if (hasImageExtention(name)) {
+                images.push_back(prefix + name);
+            }
+        }
+        closedir(dir);
+
+        std::sort(images.begin(), images.end());
+        return true;
+    }
+
+    std::ifstream manifest(input.c_str());
+    if (!manifest) {
+        std::cerr << "Can't open manifest " << input << std::endl;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(manifest, line)) {
+        if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        if (!line.empty() && line[0] != '#') {
+            images.push_back(line);
+        }
+    }
+    return true;
+}
+
+int runBatch(const BatchOptions& options) {
+    std::vector<std::string> images;
+    if (!collectImages(options.input, images)) {
+        return 1;
+    }
+
+    if (images.empty()) {
+        std::cerr << "No images found in " << options.input << std::endl;
+        return 1;
+    }
+
+    // tiled images use all cores themselves and keep memory bounded only if they go one by one
+    int workersCount = options.threads > 0 ? options.threads :
+                       options.pipeline.tiled ? 1 : cv::getNumberOfCPUs();
+    workersCount = std::max(1, std::min(workersCount, (int)images.size()));
+
+    // images are already processed in parallel,
+    // don't let OpenCV oversubscribe the cores inside every worker
+    int prevCvThreads = cv::getNumThreads();
+    if (workersCount > 1) {
+        cv::setNumThreads(1);
+    }
+
+    if (!options.tracePath.empty()) {
+        clearTrace();
+        enableTracing(true);
+    }
+
+    std::cout << "Processing " << images.size() << " images with "
+              << workersCount << " workers" << std::endl;
+
+    std::vector<BatchResult> results(images.size());
+    std::atomic<size_t> nextImage(0);
+    std::mutex logMutex;
+
+    double t = (double)cv::getTickCount();
+
+    std::vector<std::thread> workers;
+    for (int w = 0; w < workersCount; ++w) {
+        workers.push_back(std::thread([&]() {
+            for (size_t i = nextImage++; i < images.size(); i = nextImage++) {
+                results[i] = processImage(images[i], options, logMutex);
+            }
+        }));
+    }
+    for (size_t w = 0; w < workers.size(); ++w) {
+        workers[w].join();
+    }
+
+    double seconds = ((double)cv::getTickCount() - t) / cv::getTickFrequency();
+
+    cv::setNumThreads(prevCvThreads);
+
+    size_t succeeded = 0;
+    double megapixels = 0;
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (results[i].ok) {
+            ++succeeded;
+            megapixels += results[i].megapixels;
+        }
+    }
+
+    std::cout << "Done: " << succeeded << " of " << images.size() << " images in " << seconds << " s\n"
+              << "Throughput: " << succeeded / seconds << " images/s, "
+              << megapixels / seconds << " MP/s" << std::endl;
+
+    if (!options.tracePath.empty()) {
+        enableTracing(false);
+        printTraceSummary(std::cout);
+        if (writeChromeTrace(options.tracePath)) {
+            std::cout << "Trace saved to " << options.tracePath << std::endl;
+        } else {
+            std::cerr << "Can't write trace " << options.tracePath << std::endl;
+        }
+    }
+
+    return succeeded == images.size() ? 0 : 1;
+}
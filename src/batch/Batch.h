@@ -0,0 +1,32 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+
+#include "Pipeline.h"
+
+struct BatchOptions {
+    BatchOptions() : threads(0), labelFiles(false) {}
+
+    // directory with *.jpg / *.tif scenes or a manifest file with one image path per line
+    std::string input;
+    // number of images processed at the same time, 0 means one worker per core
+    int threads;
+    PipelineOptions pipeline;
+    // Chrome / Perfetto JSON trace of all stages, no tracing if empty
+    std::string tracePath;
+    // masks are saved as _mask.lbl label files (see LabelFile.h) instead of PNG,
+    // markers are read from _zMarkers.lbl rather than _zMarkers.png when both exist
+    bool labelFiles;
+};
+
+// Headless mode: segments every image from options.input using its
+// _zMarkers.png (or _zMarkers.lbl) file and writes the result next to it as _mask.png.
+// Returns process exit code.
+int runBatch(const BatchOptions& options);
+
+// Images of a directory (*.jpg / *.tif, sorted) or of a manifest file (one path per line, # comments)
+bool collectImages(const std::string& input, std::vector<std::string>& images);
+
+#endif // BATCH_H
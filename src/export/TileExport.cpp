@@ -0,0 +1,264 @@
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "TileExport.h"
+#include "Batch.h"
+#include "Palette.h"
+#include "FileUtils.h"
+#include "LabelFile.h"
+#include "Trace.h"
+
+namespace {
+
+// labels which aren't classes (threshold, boundaries, regions) are counted together in the last one
+const int COMPOSITION_SIZE = CLASS_COUNT + 1;
+
+struct ExportedTile {
+    ExportedTile() : written(false) {
+        std::fill(pixels, pixels + COMPOSITION_SIZE, 0);
+    }
+
+    cv::Rect rect;
+    size_t pixels[COMPOSITION_SIZE];
+    bool written;
+};
+
+struct ExportStats {
+    ExportStats() : tiles(0), written(0), ignored(0), unbalanced(0), failed(0) {}
+
+    size_t tiles, written, ignored, unbalanced, failed;
+};
+
+void countLabels(const cv::Mat& mask, size_t* pixels) {
+    size_t counts[LABEL_COUNT] = {};
+    for (int i = 0; i < mask.rows; ++i) {
+        const uchar* row = mask.ptr<uchar>(i);
+        for (int j = 0; j < mask.cols; ++j) {
+            ++counts[row[j]];
+        }
+    }
+    for (int label = 0; label < LABEL_COUNT; ++label) {
+        pixels[std::min(label, COMPOSITION_SIZE - 1)] += counts[label];
+    }
+}
+
+bool isIgnored(const ExportedTile& tile, const TileExportOptions& options, ExportStats& stats) {
+    const double area = tile.rect.area();
+    if ((tile.pixels[unknownLabel] + tile.pixels[notSpecifiedLabel]) > options.maxIgnoredFraction * area) {
+        ++stats.ignored;
+        return true;
+    }
+
+    int classes = 0;
+    for (int label = 0; label < CLASS_COUNT; ++label) {
+        if (label != unknownLabel && label != notSpecifiedLabel &&
+            tile.pixels[label] > 0 && tile.pixels[label] >= options.minClassFraction * area) {
+            ++classes;
+        }
+    }
+    if (classes < options.minClasses) {
+        ++stats.unbalanced;
+        return true;
+    }
+    return false;
+}
+
+std::string baseName(const std::string& filename) {
+    const std::string pure = removeExtention(filename, false);
+    const size_t slash = pure.rfind('/');
+    return slash == std::string::npos ? pure : pure.substr(slash + 1);
+}
+
+// images from different directories can have the same name, so names start with the image index
+std::string tileName(size_t index, const std::string& base, const cv::Rect& rect) {
+    return std::to_string(index) + "_" + base + "_" + std::to_string(rect.x) + "_" + std::to_string(rect.y);
+}
+
+// RFC 4180: fields with commas, quotes or line breaks are quoted, quotes are doubled
+std::string csvField(const std::string& field) {
+    if (field.find_first_of(",\"\r\n") == std::string::npos) {
+        return field;
+    }
+    std::string quoted = "\"";
+    for (size_t i = 0; i < field.size(); ++i) {
+        if (field[i] == '"') {
+            quoted += '"';
+        }
+        quoted += field[i];
+    }
+    return quoted + "\"";
+}
+
+// maskFilename gets the file the mask is read from
+cv::Mat loadMask(const std::string& filename, bool labelFiles, std::string& maskFilename) {
+    const std::string pngFilename = genMaskFileName(filename);
+    maskFilename = pickLabelsFile(pngFilename, labelFiles);
+    if (maskFilename.empty()) {
+        return cv::Mat();
+    }
+    if (maskFilename != pngFilename) {
+        return readLabelFile(maskFilename);
+    }
+
+    cv::Mat labels;
+    cv::Mat maskColors = cv::imread(maskFilename, cv::IMREAD_COLOR);
+    if (!maskColors.empty() && !labelsFromColors(maskColors, labels)) {
+        std::cerr << maskFilename << " has a region touching regions of all region labels" << std::endl;
+    }
+    return labels;
+}
+
+// index is the position of the image in the input list
+bool exportImage(const std::string& filename, size_t index, const TileExportOptions& options, int workersCount,
+                 std::ostream& manifest, ExportStats& stats) {
+    TRACE_SCOPE("export/image");
+
+    cv::Mat img0, mask;
+    std::string maskFilename;
+    {
+        TRACE_SCOPE("load/image");
+        img0 = cv::imread(filename, cv::IMREAD_COLOR);
+        mask = loadMask(filename, options.labelFiles, maskFilename);
+    }
+    if (img0.empty() || mask.empty() || img0.size() != mask.size()) {
+        std::cerr << filename << ": can't read image or its mask, or their sizes differ, skipping" << std::endl;
+        return false;
+    }
+
+    const int size = options.tileSize;
+    const int stride = options.stride > 0 ? options.stride : size;
+    std::vector<ExportedTile> tiles;
+    for (int y = 0; y + size <= img0.rows; y += stride) {
+        for (int x = 0; x + size <= img0.cols; x += stride) {
+            tiles.push_back(ExportedTile());
+            tiles.back().rect = cv::Rect(x, y, size, size);
+        }
+    }
+
+    const std::string base = baseName(filename);
+    const std::string prefix = options.outputDir[options.outputDir.size() - 1] == '/'
+            ? options.outputDir : options.outputDir + "/";
+
+    // tiles are views of img0 and mask, only the encoded file of every worker's current tile is extra memory
+    std::atomic<size_t> nextTile(0);
+    std::vector<ExportStats> workerStats(std::max(1, std::min(workersCount, (int)tiles.size())));
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < workerStats.size(); ++w) {
+        workers.push_back(std::thread([&, w]() {
+            TRACE_SCOPE("export/tiles");
+            for (size_t t = nextTile++; t < tiles.size(); t = nextTile++) {
+                ExportedTile& tile = tiles[t];
+                const cv::Mat maskTile = mask(tile.rect);
+                countLabels(maskTile, tile.pixels);
+                if (isIgnored(tile, options, workerStats[w])) {
+                    continue;
+                }
+
+                const std::string name = prefix + tileName(index, base, tile.rect);
+                if (!cv::imwrite(name + ".png", img0(tile.rect)) || !cv::imwrite(name + "_mask.png", maskTile)) {
+                    ++workerStats[w].failed;
+                    continue;
+                }
+                tile.written = true;
+                ++workerStats[w].written;
+            }
+        }));
+    }
+    for (size_t w = 0; w < workers.size(); ++w) {
+        workers[w].join();
+    }
+
+    stats.tiles += tiles.size();
+    size_t written = 0;
+    for (size_t w = 0; w < workerStats.size(); ++w) {
+        written += workerStats[w].written;
+        stats.written += workerStats[w].written;
+        stats.ignored += workerStats[w].ignored;
+        stats.unbalanced += workerStats[w].unbalanced;
+        stats.failed += workerStats[w].failed;
+    }
+
+    // in tile order, whatever order the workers finished in
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        const ExportedTile& tile = tiles[t];
+        if (!tile.written) {
+            continue;
+        }
+        const std::string name = tileName(index, base, tile.rect);
+        manifest << csvField(name + ".png") << "," << csvField(name + "_mask.png") << "," << csvField(filename) << ","
+                 << tile.rect.x << "," << tile.rect.y;
+        for (int k = 0; k < COMPOSITION_SIZE; ++k) {
+            manifest << "," << (double)tile.pixels[k] / tile.rect.area();
+        }
+        manifest << "\n";
+    }
+    manifest.flush();
+
+    std::cout << filename << ": " << written << " of " << tiles.size() << " tiles exported (mask from "
+              << maskFilename << ")" << std::endl;
+    return true;
+}
+
+} // namespace
+
+int runTileExport(const TileExportOptions& options) {
+    if (options.tileSize <= 0 || options.outputDir.empty() || !is_directory(options.outputDir)) {
+        std::cerr << "Tile size has to be positive and output directory has to exist" << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> images;
+    if (!collectImages(options.input, images)) {
+        return 1;
+    }
+    if (images.empty()) {
+        std::cerr << "No images found in " << options.input << std::endl;
+        return 1;
+    }
+
+    const std::string manifestPath = options.outputDir + "/manifest.csv";
+    std::ofstream manifest(manifestPath.c_str());
+    if (!manifest) {
+        std::cerr << "Can't write " << manifestPath << std::endl;
+        return 1;
+    }
+    manifest << "image,mask,source,x,y";
+    for (int label = 0; label < CLASS_COUNT; ++label) {
+        manifest << "," << labelName((uchar)label);
+    }
+    manifest << ",other\n";
+
+    const int workersCount = options.threads > 0 ? options.threads : cv::getNumberOfCPUs();
+
+    // PNG encoding is single threaded, workers are the only parallelism
+    int prevCvThreads = cv::getNumThreads();
+    cv::setNumThreads(1);
+
+    double t = (double)cv::getTickCount();
+
+    ExportStats stats;
+    size_t succeeded = 0;
+    for (size_t i = 0; i < images.size(); ++i) {
+        succeeded += exportImage(images[i], i, options, workersCount, manifest, stats);
+    }
+
+    double seconds = ((double)cv::getTickCount() - t) / cv::getTickFrequency();
+
+    cv::setNumThreads(prevCvThreads);
+
+    std::cout << "Done: " << stats.written << " of " << stats.tiles << " tiles from "
+              << succeeded << " of " << images.size() << " images in " << seconds << " s\n"
+              << "Skipped: " << stats.ignored << " mostly unknown or not specified, "
+              << stats.unbalanced << " below class balance threshold, "
+              << stats.failed << " couldn't be written\n"
+              << "Manifest saved to " << manifestPath << std::endl;
+
+    return succeeded == images.size() && stats.failed == 0 && manifest ? 0 : 1;
+}
@@ -0,0 +1,40 @@
+#ifndef TILE_EXPORT_H
+#define TILE_EXPORT_H
+
+#include <string>
+
+struct TileExportOptions {
+    TileExportOptions()
+        : tileSize(256), stride(0), maxIgnoredFraction(0.5), minClasses(1), minClassFraction(0.05), threads(0)
+        , labelFiles(false) {}
+
+    // directory with *.jpg / *.tif scenes or a manifest file with one image path per line,
+    // every image needs its _mask.lbl or _mask.png
+    std::string input;
+    // tiles and manifest.csv are written there, it has to exist
+    std::string outputDir;
+    // tiles are tileSize x tileSize, stride apart (tileSize if 0), partial tiles at the edges are skipped
+    int tileSize;
+    int stride;
+    // tiles with more unknown and not specified pixels are skipped
+    double maxIgnoredFraction;
+    // tiles are skipped unless at least minClasses classes (other than unknown and not specified)
+    // cover minClassFraction of the tile each
+    int minClasses;
+    double minClassFraction;
+    // tiles encoded and written at the same time, 0 means one worker per core
+    int threads;
+    // masks are read from _mask.lbl rather than _mask.png when both exist
+    bool labelFiles;
+};
+
+// Cuts every image and its mask into training tiles: <index>_<name>_<x>_<y>.png (BGR) and
+// <index>_<name>_<x>_<y>_mask.png (grayscale labels, see Palette.h), index is the position of the image
+// in the input, so images with the same name from different directories don't overwrite each other's tiles.
+// Images are loaded one at a time, tiles are views of them encoded and written by the workers,
+// so memory stays at one image and mask plus one encoded tile per worker.
+// manifest.csv (RFC 4180 quoting) lists every written tile with the fraction of every class in it.
+// Returns process exit code.
+int runTileExport(const TileExportOptions& options);
+
+#endif // TILE_EXPORT_H
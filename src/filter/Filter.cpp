@@ -1,63 +1,282 @@
-#include "opencv2/imgproc.hpp"
+#include "opencv2/core/utility.hpp"
 
-#include <unordered_set>
-#include <unordered_map>
+#include <atomic>
 #include <iostream>
 
-#include"ColorTypesExtensions.h"
+#include "Filter.h"
+#include "Trace.h"
 
-void processWindow(cv::Mat& img, std::unordered_set<CvScalar>& validColors, int winSize, int x, int y) {
-    std::unordered_map<CvScalar, int> colorsCnt;
+namespace {
 
-    int sizeX = std::min(winSize, img.cols - x);
-    int sizeY = std::min(winSize, img.rows - y);
+// Counts rows done by all threads, reports it to the job every few rows
+class RowProgress {
+public:
+    RowProgress(JobContext* context, int rows) : context_(context), rows_(std::max(1, rows)), done_(0) {}
 
-    for (size_t i = x; i < x + sizeX; ++i) {
-        for (size_t j = y; j < y + sizeY; ++j) {
-            if (i >= img.cols || j >= img.rows) {
-                std::cerr << "Point (" << i << ", " << j << ") doesn't belong to image" << std::endl << std::endl;
-                return;
+    // returns false if the job is cancelled
+    bool add(int rows) {
+        if (!context_) {
+            return true;
+        }
+        const int done = done_ += rows;
+        if ((done - rows) / REPORT_ROWS != done / REPORT_ROWS) {
+            context_->setProgress((double)done / rows_);
+        }
+        return !context_->cancelled();
+    }
+
+private:
+    static const int REPORT_ROWS = 64;
+
+    JobContext* context_;
+    const int rows_;
+    std::atomic<int> done_;
+};
+
+// Processes one row of windows [y, y + sizeY) at once, walking the memory row by row.
+// hist has room for CLASS_COUNT counters per window of the row.
+void processWindowsRow(cv::Mat& img, const uchar* validTable, int winSize, int y,
+                       int* hist, uchar* winners, FilterStats& stats) {
+    const int sizeY = std::min(winSize, img.rows - y);
+    const int windowsCnt = (img.cols + winSize - 1) / winSize;
+
+    std::fill(hist, hist + windowsCnt * CLASS_COUNT, 0);
+
+    for (int i = y; i < y + sizeY; ++i) {
+        const uchar* row = img.ptr<uchar>(i);
+        int* winHist = hist;
+        for (int x = 0; x < img.cols; x += winSize, winHist += CLASS_COUNT) {
+            const int xEnd = std::min(x + winSize, img.cols);
+            for (int j = x; j < xEnd; ++j) {
+                uchar label = row[j];
+                if (validTable[label]) {
+                    winHist[label]++;
+                }
             }
-            auto curPixelCol = getColor(img, j, i);
+        }
+    }
 
-            if (validColors.find(curPixelCol) != validColors.end()) {
-                colorsCnt[curPixelCol]++;
+    bool anyWinner = false;
+    for (int w = 0; w < windowsCnt; ++w) {
+        const int* winHist = hist + w * CLASS_COUNT;
+        int best = 0;
+        for (int label = 1; label < CLASS_COUNT; ++label) {
+            if (winHist[label] > winHist[best]) {
+                best = label;
             }
         }
+
+        // 0 means nothing to fill with
+        winners[w] = winHist[best] > 0 ? (uchar)(best + 1) : 0;
+        if (winners[w]) {
+            anyWinner = true;
+        } else {
+            stats.emptyWindows++;
+        }
     }
+    stats.windows += windowsCnt;
 
-    if (colorsCnt.empty()) {
-        std::cerr << "No valid colors in window (" << x << ", " << y <<
-                ") - (" << x + sizeX << ", " << y + sizeY << "),\n skipping" << std::endl;
+    if (!anyWinner) {
         return;
     }
 
-    auto mostRecentColor = std::max_element(colorsCnt.begin(), colorsCnt.end(),
-                                            [](const std::pair<CvScalar, int>& p1, const std::pair<CvScalar, int>& p2) {
-        return p1.second < p2.second; })->first;
-
-    for (size_t i = x; i < x + sizeX; ++i) {
-        for (size_t j = y; j < y + sizeY; ++j) {
-            auto curPixelCol = getColor(img, j, i);
-            if (validColors.find(curPixelCol) == validColors.end()) {
-                //                std::cerr << curPixelCol.val[2] << std::endl;
-                //                std::cerr << curPixelCol.val[1] << std::endl;
-                //                std::cerr << curPixelCol.val[0] << std::endl << std::endl;
-                img.at<cv::Vec3b>(j, i) = cvScalar2Vec3b(mostRecentColor);
+    for (int i = y; i < y + sizeY; ++i) {
+        uchar* row = img.ptr<uchar>(i);
+        const uchar* winner = winners;
+        for (int x = 0; x < img.cols; x += winSize, ++winner) {
+            if (!*winner) {
+                continue;
+            }
+            const uchar fill = *winner - 1;
+            const int xEnd = std::min(x + winSize, img.cols);
+            for (int j = x; j < xEnd; ++j) {
+                if (!validTable[row[j]]) {
+                    row[j] = fill;
+                    stats.replacedPixels++;
+                }
             }
         }
     }
 }
 
-void invalidColorFilter(cv::Mat& img, std::unordered_set<CvScalar>& validColors, int winSize = 10) {
+} // namespace
+
+FilterStats invalidColorFilter(cv::Mat& img, const LabelSet& validLabels, int winSize, JobContext* context) {
+    TRACE_SCOPE("filter/block");
+    CV_Assert(img.type() == CV_8U);
+
+    FilterStats stats;
     if (img.cols <= winSize || img.rows <= winSize || winSize <= 0) {
         std::cerr << "Bad window size" << std::endl;
-        return;
+        return stats;
+    }
+
+    uchar validTable[LABEL_COUNT];
+    for (int label = 0; label < LABEL_COUNT; ++label) {
+        validTable[label] = isValidLabel(validLabels, (uchar)label);
+    }
+
+    const int windowsCnt = (img.cols + winSize - 1) / winSize;
+    const int windowRowsCnt = (img.rows + winSize - 1) / winSize;
+
+    std::atomic<size_t> windows(0), emptyWindows(0), replacedPixels(0);
+    RowProgress progress(context, windowRowsCnt);
+
+    // rows of windows are independent, every stripe reuses its own buffers
+    cv::parallel_for_(cv::Range(0, windowRowsCnt), [&](const cv::Range& range) {
+        std::vector<int> hist(windowsCnt * CLASS_COUNT);
+        std::vector<uchar> winners(windowsCnt);
+        FilterStats local;
+
+        for (int r = range.start; r < range.end; ++r) {
+            processWindowsRow(img, validTable, winSize, r * winSize, &hist[0], &winners[0], local);
+            if (!progress.add(1)) {
+                break;
+            }
+        }
+
+        windows += local.windows;
+        emptyWindows += local.emptyWindows;
+        replacedPixels += local.replacedPixels;
+    });
+
+    stats.windows = windows;
+    stats.emptyWindows = emptyWindows;
+    stats.replacedPixels = replacedPixels;
+    return stats;
+}
+
+namespace {
+
+inline void addRow(const uchar* row, int cols, const uchar* validTable, int* colHist, int delta) {
+    for (int j = 0; j < cols; ++j, colHist += CLASS_COUNT) {
+        uchar label = row[j];
+        if (validTable[label]) {
+            colHist[label] += delta;
+        }
+    }
+}
+
+inline void addHist(int* dst, const int* src, int delta) {
+    for (int k = 0; k < CLASS_COUNT; ++k) {
+        dst[k] += delta * src[k];
+    }
+}
+
+// Filters rows [rowsBegin, rowsEnd) of dst reading labels from src (Huang / Perreault-Hebert):
+// every column keeps histogram of its 2*radius + 1 rows, which moves down by one add and one remove,
+// window histogram moves right by adding one column histogram and removing another one.
+void slidingModeRows(const cv::Mat& src, cv::Mat& dst, const uchar* validTable, int radius,
+                     int rowsBegin, int rowsEnd, std::vector<int>& colHist, FilterStats& stats,
+                     RowProgress& progress) {
+    const int rows = src.rows, cols = src.cols;
+
+    // rows [rowsBegin - radius - 1, rowsBegin + radius), the loop below shifts it by one row
+    std::fill(colHist.begin(), colHist.end(), 0);
+    for (int i = std::max(0, rowsBegin - radius - 1); i < std::min(rows, rowsBegin + radius); ++i) {
+        addRow(src.ptr<uchar>(i), cols, validTable, &colHist[0], 1);
     }
 
-    for (size_t i = 0; i < img.cols ; i += winSize) {
-        for (size_t j = 0; j < img.rows; j += winSize) {
-            processWindow(img, validColors, winSize, i, j);
+    int winHist[CLASS_COUNT];
+
+    for (int y = rowsBegin; y < rowsEnd; ++y) {
+        if (!progress.add(1)) {
+            return;
+        }
+        if (y - radius - 1 >= 0) {
+            addRow(src.ptr<uchar>(y - radius - 1), cols, validTable, &colHist[0], -1);
+        }
+        if (y + radius < rows) {
+            addRow(src.ptr<uchar>(y + radius), cols, validTable, &colHist[0], 1);
+        }
+
+        const uchar* srcRow = src.ptr<uchar>(y);
+        uchar* dstRow = dst.ptr<uchar>(y);
+
+        int firstInvalid = 0;
+        while (firstInvalid < cols && validTable[srcRow[firstInvalid]]) {
+            ++firstInvalid;
+        }
+        if (firstInvalid == cols) {
+            continue;
+        }
+
+        std::fill(winHist, winHist + CLASS_COUNT, 0);
+        for (int j = 0; j <= std::min(cols - 1, radius); ++j) {
+            addHist(winHist, &colHist[j * CLASS_COUNT], 1);
+        }
+
+        for (int x = 0; x < cols; ++x) {
+            if (x > 0) {
+                if (x + radius < cols) {
+                    addHist(winHist, &colHist[(x + radius) * CLASS_COUNT], 1);
+                }
+                if (x - radius - 1 >= 0) {
+                    addHist(winHist, &colHist[(x - radius - 1) * CLASS_COUNT], -1);
+                }
+            }
+
+            if (x < firstInvalid || validTable[srcRow[x]]) {
+                continue;
+            }
+
+            stats.windows++;
+
+            int best = 0;
+            for (int label = 1; label < CLASS_COUNT; ++label) {
+                if (winHist[label] > winHist[best]) {
+                    best = label;
+                }
+            }
+
+            if (winHist[best] > 0) {
+                dstRow[x] = (uchar)best;
+                stats.replacedPixels++;
+            } else {
+                stats.emptyWindows++;
+            }
         }
     }
 }
+
+} // namespace
+
+FilterStats slidingModeFilter(cv::Mat& img, const LabelSet& validLabels, int radius, JobContext* context) {
+    TRACE_SCOPE("filter/sliding");
+    CV_Assert(img.type() == CV_8U);
+
+    FilterStats stats;
+    if (radius <= 0) {
+        std::cerr << "Bad window size" << std::endl;
+        return stats;
+    }
+
+    uchar validTable[LABEL_COUNT];
+    for (int label = 0; label < LABEL_COUNT; ++label) {
+        validTable[label] = isValidLabel(validLabels, (uchar)label);
+    }
+
+    // windows have to see labels before filtering
+    const cv::Mat src = img.clone();
+
+    std::atomic<size_t> windows(0), emptyWindows(0), replacedPixels(0);
+    RowProgress progress(context, img.rows);
+
+    // every stripe has to build its column histograms from scratch,
+    // so don't split rows into more stripes than there are threads
+    cv::parallel_for_(cv::Range(0, img.rows), [&](const cv::Range& range) {
+        std::vector<int> colHist(img.cols * CLASS_COUNT);
+        FilterStats local;
+
+        slidingModeRows(src, img, validTable, radius, range.start, range.end, colHist, local, progress);
+
+        windows += local.windows;
+        emptyWindows += local.emptyWindows;
+        replacedPixels += local.replacedPixels;
+    }, std::max(1, cv::getNumThreads()));
+
+    stats.windows = windows;
+    stats.emptyWindows = emptyWindows;
+    stats.replacedPixels = replacedPixels;
+    return stats;
+}
@@ -1,6 +1,34 @@
 #ifndef FILTER_H
 #define FILTER_H
 
-void invalidColorFilter(cv::Mat& img, std::unordered_set<CvScalar>& validColors, int winSize = 10);
+#include "Palette.h"
+#include "JobContext.h"
+
+const int DEFAULT_FILTER_WIN_SIZE = 10;
+const int DEFAULT_FILTER_RADIUS = 5;
+
+struct FilterStats {
+    FilterStats() : windows(0), emptyWindows(0), replacedPixels(0) {}
+
+    size_t windows;
+    // windows without any valid label, left as is
+    size_t emptyWindows;
+    size_t replacedPixels;
+};
+
+// Splits img into winSize x winSize blocks and replaces every invalid label
+// in a block with the most frequent valid label of that block
+// (the smallest label wins a tie).
+// Both filters report progress to context if given and stop early when it's cancelled,
+// img is partially filtered then.
+FilterStats invalidColorFilter(cv::Mat& img, const LabelSet& validLabels, int winSize = DEFAULT_FILTER_WIN_SIZE,
+                               JobContext* context = 0);
+
+// Replaces every invalid label with the most frequent valid label of the
+// (2*radius + 1) x (2*radius + 1) window centered on it (clipped by image borders).
+// Uses running column histograms, so the cost doesn't depend on radius.
+// Here FilterStats::windows counts invalid pixels looked at.
+FilterStats slidingModeFilter(cv::Mat& img, const LabelSet& validLabels, int radius = DEFAULT_FILTER_RADIUS,
+                              JobContext* context = 0);
 
 #endif
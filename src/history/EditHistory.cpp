@@ -0,0 +1,247 @@
+#include <iostream>
+
+#include "EditHistory.h"
+#include "LabelFile.h"
+
+namespace {
+
+size_t tileBytes(const std::vector<uchar>& before, const std::vector<uchar>& after) {
+    return before.capacity() + after.capacity();
+}
+
+template<typename Edit>
+bool changesLayer(const Edit& edit, const cv::Mat& layer) {
+    for (size_t k = 0; k < edit.tiles.size(); ++k) {
+        if (edit.tiles[k].layer == &layer) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+EditHistory::EditHistory(size_t memoryCapBytes, int tileSize)
+    : cap_(memoryCapBytes)
+    , tileSize_(tileSize)
+    , bytes_(0)
+    , recording_(false)
+{
+}
+
+void EditHistory::begin(const std::string& name, EditStatePtr before) {
+    if (recording_) {
+        commit();
+    }
+    recording_ = true;
+    current_ = Edit();
+    current_.name = name;
+    current_.before = before;
+    touched_.clear();
+}
+
+void EditHistory::touch(cv::Mat& layer, const cv::Rect& rect) {
+    CV_Assert(layer.type() == CV_8U);
+    if (!recording_) {
+        begin("edit");
+    }
+
+    const cv::Rect layerRect(0, 0, layer.cols, layer.rows);
+    const cv::Rect r = rect & layerRect;
+    if (r.area() == 0) {
+        return;
+    }
+
+    const int tilesX = (layer.cols + tileSize_ - 1) / tileSize_;
+    for (int ty = r.y / tileSize_; ty <= (r.y + r.height - 1) / tileSize_; ++ty) {
+        for (int tx = r.x / tileSize_; tx <= (r.x + r.width - 1) / tileSize_; ++tx) {
+            const std::pair<const cv::Mat*, int> key(&layer, ty * tilesX + tx);
+            if (touched_.count(key)) {
+                continue;
+            }
+            touched_[key] = current_.tiles.size();
+
+            Tile tile;
+            tile.layer = &layer;
+            tile.rect = cv::Rect(tx * tileSize_, ty * tileSize_, tileSize_, tileSize_) & layerRect;
+            encodeLabelRuns(layer(tile.rect), tile.before);
+            current_.tiles.push_back(tile);
+        }
+    }
+}
+
+void EditHistory::commit(EditStatePtr after) {
+    if (!recording_) {
+        return;
+    }
+    recording_ = false;
+    touched_.clear();
+
+    Edit edit;
+    edit.name = current_.name;
+    edit.before = current_.before;
+    edit.after = after;
+    for (size_t k = 0; k < current_.tiles.size(); ++k) {
+        Tile& tile = current_.tiles[k];
+        encodeLabelRuns((*tile.layer)(tile.rect), tile.after);
+        if (tile.after == tile.before) {
+            continue;
+        }
+        tile.before.shrink_to_fit();
+        tile.after.shrink_to_fit();
+        edit.bytes += tileBytes(tile.before, tile.after);
+        edit.tiles.push_back(Tile());
+        std::swap(edit.tiles.back(), tile);
+    }
+    current_ = Edit();
+
+    push(edit);
+}
+
+void EditHistory::push(Edit& edit) {
+    if (edit.tiles.empty()) {
+        return;
+    }
+
+    for (size_t k = 0; k < redo_.size(); ++k) {
+        bytes_ -= redo_[k].bytes;
+    }
+    redo_.clear();
+
+    bytes_ += edit.bytes;
+    undo_.push_back(Edit());
+    std::swap(undo_.back(), edit);
+    evict();
+}
+
+void EditHistory::replace(cv::Mat& layer, cv::Mat& with, const std::string& name,
+                          EditStatePtr before, EditStatePtr after) {
+    // The open edit goes on if it's about other layers (a job result arriving in the middle of a stroke).
+    // Otherwise its saved tiles would be from before the replacement, it's finished first.
+    if (recording_ && changesLayer(current_, layer)) {
+        commit();
+    }
+
+    if (layer.size() != with.size() || layer.type() != CV_8U || with.type() != CV_8U) {
+        forget(layer);
+        std::swap(layer, with);
+        return;
+    }
+
+    Edit edit;
+    edit.name = name;
+    edit.before = before;
+    edit.after = after;
+    for (int y = 0; y < layer.rows; y += tileSize_) {
+        for (int x = 0; x < layer.cols; x += tileSize_) {
+            Tile tile;
+            tile.layer = &layer;
+            tile.rect = cv::Rect(x, y, tileSize_, tileSize_) & cv::Rect(0, 0, layer.cols, layer.rows);
+            encodeLabelRuns(layer(tile.rect), tile.before);
+            encodeLabelRuns(with(tile.rect), tile.after);
+            if (tile.before == tile.after) {
+                continue;
+            }
+            tile.before.shrink_to_fit();
+            tile.after.shrink_to_fit();
+            edit.bytes += tileBytes(tile.before, tile.after);
+            edit.tiles.push_back(Tile());
+            std::swap(edit.tiles.back(), tile);
+        }
+    }
+    std::swap(layer, with);
+    push(edit);
+}
+
+void EditHistory::forget(const cv::Mat& layer) {
+    if (recording_ && changesLayer(current_, layer)) {
+        commit();
+    }
+
+    std::deque<Edit> undo, redo;
+    bytes_ = 0;
+    for (size_t k = 0; k < undo_.size(); ++k) {
+        if (!changesLayer(undo_[k], layer)) {
+            bytes_ += undo_[k].bytes;
+            undo.push_back(Edit());
+            std::swap(undo.back(), undo_[k]);
+        }
+    }
+    for (size_t k = 0; k < redo_.size(); ++k) {
+        if (!changesLayer(redo_[k], layer)) {
+            bytes_ += redo_[k].bytes;
+            redo.push_back(Edit());
+            std::swap(redo.back(), redo_[k]);
+        }
+    }
+    undo_.swap(undo);
+    redo_.swap(redo);
+}
+
+void EditHistory::apply(const Edit& edit, bool after, std::vector<Change>& changes) const {
+    changes.clear();
+    for (size_t k = 0; k < edit.tiles.size(); ++k) {
+        const Tile& tile = edit.tiles[k];
+        cv::Mat dst = (*tile.layer)(tile.rect);
+        const std::vector<uchar>& data = after ? tile.after : tile.before;
+        if (!decodeLabelRuns(&data[0], data.size(), dst)) {
+            std::cerr << "Broken edit history tile" << std::endl;
+        }
+
+        size_t c = 0;
+        while (c < changes.size() && changes[c].layer != tile.layer) {
+            ++c;
+        }
+        if (c == changes.size()) {
+            Change change = {tile.layer, tile.rect};
+            changes.push_back(change);
+        } else {
+            changes[c].rect |= tile.rect;
+        }
+    }
+}
+
+bool EditHistory::undo(std::vector<Change>& changes, std::string& name, EditStatePtr& state) {
+    if (recording_) {
+        commit();
+    }
+    if (undo_.empty()) {
+        return false;
+    }
+
+    apply(undo_.back(), false, changes);
+    name = undo_.back().name;
+    state = undo_.back().before;
+    redo_.push_back(Edit());
+    std::swap(redo_.back(), undo_.back());
+    undo_.pop_back();
+    return true;
+}
+
+bool EditHistory::redo(std::vector<Change>& changes, std::string& name, EditStatePtr& state) {
+    if (recording_) {
+        commit();
+    }
+    if (redo_.empty()) {
+        return false;
+    }
+
+    apply(redo_.back(), true, changes);
+    name = redo_.back().name;
+    state = redo_.back().after;
+    undo_.push_back(Edit());
+    std::swap(undo_.back(), redo_.back());
+    redo_.pop_back();
+    return true;
+}
+
+void EditHistory::evict() {
+    // Redo history counts too, the edits farthest from the current state go first:
+    // redo ones from the newest, then undo ones from the oldest.
+    // The last edit stays even if it alone is over the cap.
+    while (bytes_ > cap_ && undo_.size() + redo_.size() > 1) {
+        std::deque<Edit>& edits = redo_.empty() ? undo_ : redo_;
+        bytes_ -= edits.front().bytes;
+        edits.pop_front();
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef EDIT_HISTORY_H
+#define EDIT_HISTORY_H
+
+#include "opencv2/core.hpp"
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Undo / redo of edits of CV_8U layers (markers, mask), identified by the cv::Mat objects holding them.
+// An edit keeps only the tiles it changed, run-length compressed (see encodeLabelRuns), before and after
+// the change, so undo and redo cost time proportional to the edited area.
+// Copy on write: callers announce rects right before changing them, the first touch of a tile
+// within an edit saves its old content.
+// When the history (undo and redo) takes more than memory cap, the edits farthest from the current state
+// are forgotten first.
+
+// What the owner of layers derives from them (statistics, ...), kept with an edit as it was
+// before and after it and handed back by undo / redo, so it doesn't have to be computed again
+class EditState {
+public:
+    virtual ~EditState() {}
+};
+typedef std::shared_ptr<const EditState> EditStatePtr;
+
+class EditHistory {
+public:
+    // area a layer changed by undo / redo
+    struct Change {
+        cv::Mat* layer;
+        cv::Rect rect;
+    };
+
+    explicit EditHistory(size_t memoryCapBytes = 256 << 20, int tileSize = 64);
+
+    // Starts an edit, touches outside of an edit start an unnamed one
+    void begin(const std::string& name, EditStatePtr before = EditStatePtr());
+
+    // Has to be called before pixels of rect in layer change
+    void touch(cv::Mat& layer, const cv::Rect& rect);
+
+    // Finishes the edit, tiles which ended up unchanged are dropped, and so is an edit without changes.
+    // Clears redo history.
+    void commit(EditStatePtr after = EditStatePtr());
+
+    // Replaces layer with `with` (swaps them) as one edit which keeps only tiles which differ.
+    // History of layer is forgotten if the sizes differ.
+    // An open edit of other layers stays open, it's committed first if it changes layer.
+    void replace(cv::Mat& layer, cv::Mat& with, const std::string& name,
+                 EditStatePtr before = EditStatePtr(), EditStatePtr after = EditStatePtr());
+
+    // Forgets all edits of layer, for when it's replaced by something unrelated
+    void forget(const cv::Mat& layer);
+
+    // Return false if there is nothing to undo / redo, changes gets a rect per changed layer,
+    // state gets the state given for the time the layers are back to (empty if none was given)
+    bool undo(std::vector<Change>& changes, std::string& name, EditStatePtr& state);
+    bool redo(std::vector<Change>& changes, std::string& name, EditStatePtr& state);
+
+    size_t bytes() const { return bytes_; }
+
+private:
+    struct Tile {
+        cv::Mat* layer;
+        cv::Rect rect;
+        std::vector<uchar> before, after;
+    };
+
+    struct Edit {
+        Edit() : bytes(0) {}
+
+        std::string name;
+        std::vector<Tile> tiles;
+        size_t bytes;
+        EditStatePtr before, after;
+    };
+
+    // writes before or after of every tile of edit into its layer
+    void apply(const Edit& edit, bool after, std::vector<Change>& changes) const;
+    // pushes a finished edit unless it's empty, clears redo history
+    void push(Edit& edit);
+    void evict();
+
+    size_t cap_;
+    int tileSize_;
+    size_t bytes_;
+
+    bool recording_;
+    Edit current_;
+    // tiles of the current edit by layer and tile index
+    std::map<std::pair<const cv::Mat*, int>, size_t> touched_;
+
+    // the edits next to the current state at the back
+    std::deque<Edit> undo_;
+    std::deque<Edit> redo_;
+};
+
+#endif // EDIT_HISTORY_H
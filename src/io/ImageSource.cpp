@@ -0,0 +1,133 @@
+#include <algorithm>
+
+#include "ImageSource.h"
+#include "LabelFile.h"
+#include "TiffImageSource.h"
+
+namespace {
+
+// image pixels readDownsampled reads at once
+const size_t DOWNSAMPLE_BAND_PIXELS = 16 << 20;
+
+} // namespace
+
+const cv::Mat& DecodedImageSource::image() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!decoded_) {
+        img_ = cv::imread(filename_, flags_);
+        decoded_ = true;
+    }
+    return img_;
+}
+
+TiledImageSource::TiledImageSource(cv::Size size, int type, cv::Size tileSize, size_t cacheBytes)
+    : size_(size)
+    , type_(type)
+    , tileSize_(tileSize)
+    , tilesX_((size.width + tileSize.width - 1) / tileSize.width)
+    , cacheBytes_(cacheBytes)
+    , cachedBytes_(0)
+{
+}
+
+cv::Mat TiledImageSource::tile(int tx, int ty) {
+    const int key = ty * tilesX_ + tx;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = cache_.find(key);
+        if (it != cache_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second.second);
+            return it->second.first;
+        }
+    }
+
+    // decode without holding the lock, so different tiles are decoded in parallel
+    cv::Rect rect(tx * tileSize_.width, ty * tileSize_.height, tileSize_.width, tileSize_.height);
+    rect &= cv::Rect(0, 0, size_.width, size_.height);
+
+    cv::Mat decoded;
+    decodeTile(rect, decoded);
+    const size_t bytes = decoded.total() * decoded.elemSize();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = cache_.find(key);
+    if (it != cache_.end()) {
+        // somebody else decoded it meanwhile
+        lru_.splice(lru_.begin(), lru_, it->second.second);
+        return it->second.first;
+    }
+
+    // tiles which are still referenced by callers stay alive after eviction
+    while (!lru_.empty() && cachedBytes_ + bytes > cacheBytes_) {
+        auto victim = cache_.find(lru_.back());
+        cachedBytes_ -= victim->second.first.total() * victim->second.first.elemSize();
+        cache_.erase(victim);
+        lru_.pop_back();
+    }
+
+    lru_.push_front(key);
+    cache_[key] = std::make_pair(decoded, lru_.begin());
+    cachedBytes_ += bytes;
+
+    return decoded;
+}
+
+cv::Mat TiledImageSource::read(const cv::Rect& roi) {
+    CV_Assert((roi & cv::Rect(0, 0, size_.width, size_.height)) == roi);
+
+    if (roi.area() == 0) {
+        return cv::Mat(roi.size(), type_);
+    }
+
+    const int tx0 = roi.x / tileSize_.width;
+    const int ty0 = roi.y / tileSize_.height;
+    const int tx1 = (roi.x + roi.width - 1) / tileSize_.width;
+    const int ty1 = (roi.y + roi.height - 1) / tileSize_.height;
+
+    if (tx0 == tx1 && ty0 == ty1) {
+        cv::Point origin(tx0 * tileSize_.width, ty0 * tileSize_.height);
+        return tile(tx0, ty0)(roi - origin);
+    }
+
+    cv::Mat dst(roi.size(), type_);
+    for (int ty = ty0; ty <= ty1; ++ty) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            cv::Rect tileRect(tx * tileSize_.width, ty * tileSize_.height, tileSize_.width, tileSize_.height);
+            cv::Rect part = tileRect & roi;
+            tile(tx, ty)(part - tileRect.tl()).copyTo(dst(part - roi.tl()));
+        }
+    }
+    return dst;
+}
+
+cv::Ptr<ImageSource> openImageSource(const std::string& filename, int flags, size_t cacheBytes) {
+    if (flags == cv::IMREAD_GRAYSCALE && isLabelFile(filename)) {
+        return openLabelFileSource(filename, cacheBytes);
+    }
+
+    cv::Ptr<ImageSource> source = openTiffImageSource(filename, flags, cacheBytes);
+    if (source) {
+        return source;
+    }
+
+    return cv::Ptr<ImageSource>(new DecodedImageSource(filename, flags));
+}
+
+cv::Mat readDownsampled(ImageSource& source, int factor, int interpolation) {
+    CV_Assert(factor >= 1);
+    const cv::Size size = source.size();
+    if (factor == 1) {
+        return source.read(cv::Rect(0, 0, size.width, size.height));
+    }
+
+    cv::Mat dst((size.height + factor - 1) / factor, (size.width + factor - 1) / factor, source.type());
+    const int bandRows = std::max(1, (int)(DOWNSAMPLE_BAND_PIXELS / ((size_t)size.width * factor)));
+    for (int y = 0; y < dst.rows; y += bandRows) {
+        const int rows = std::min(bandRows, dst.rows - y);
+        const cv::Rect band(0, y * factor, size.width, std::min(rows * factor, size.height - y * factor));
+        cv::Mat dstBand = dst.rowRange(y, y + rows);
+        cv::resize(source.read(band), dstBand, dstBand.size(), 0, 0, interpolation);
+    }
+    return dst;
+}
@@ -0,0 +1,104 @@
+#ifndef IMAGE_SOURCE_H
+#define IMAGE_SOURCE_H
+
+#include "opencv2/imgproc.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Read-only access to an image by rectangles, so the caller never has to
+// hold the whole decoded image. Implementations are thread safe.
+class ImageSource {
+public:
+    virtual ~ImageSource() {}
+
+    virtual cv::Size size() const = 0;
+    virtual int type() const = 0;
+
+    // Returns pixels of roi (which has to lie inside the image).
+    // The result may share memory with the source, don't modify it.
+    virtual cv::Mat read(const cv::Rect& roi) = 0;
+};
+
+// Image which is already in memory
+class MatImageSource : public ImageSource {
+public:
+    explicit MatImageSource(const cv::Mat& img) : img_(img) {}
+
+    cv::Size size() const { return img_.size(); }
+    int type() const { return img_.type(); }
+    cv::Mat read(const cv::Rect& roi) { return img_(roi); }
+
+private:
+    cv::Mat img_;
+};
+
+// Compressed formats can't be decoded partially by imgcodecs,
+// so the file is decoded as a whole, but only on first access.
+// Size of an image which can't be decoded is empty.
+class DecodedImageSource : public ImageSource {
+public:
+    DecodedImageSource(const std::string& filename, int flags) : filename_(filename), flags_(flags), decoded_(false) {}
+
+    cv::Size size() const { return image().size(); }
+    int type() const { return image().type(); }
+    cv::Mat read(const cv::Rect& roi) { return image()(roi); }
+
+private:
+    const cv::Mat& image() const;
+
+    std::string filename_;
+    int flags_;
+    mutable std::mutex mutex_;
+    mutable bool decoded_;
+    mutable cv::Mat img_;
+};
+
+// Splits the image into tiles which are decoded on demand
+// and kept in a LRU cache of limited size
+class TiledImageSource : public ImageSource {
+public:
+    TiledImageSource(cv::Size size, int type, cv::Size tileSize, size_t cacheBytes);
+
+    cv::Size size() const { return size_; }
+    int type() const { return type_; }
+    cv::Mat read(const cv::Rect& roi);
+
+protected:
+    // Decodes rect (which is one cache tile) into dst of type()
+    virtual void decodeTile(const cv::Rect& rect, cv::Mat& dst) = 0;
+
+private:
+    cv::Mat tile(int tx, int ty);
+
+    cv::Size size_;
+    int type_;
+    cv::Size tileSize_;
+    int tilesX_;
+    size_t cacheBytes_;
+
+    std::mutex mutex_;
+    size_t cachedBytes_;
+    // most recently used tiles first
+    std::list<int> lru_;
+    std::unordered_map<int, std::pair<cv::Mat, std::list<int>::iterator> > cache_;
+};
+
+const size_t DEFAULT_TILE_CACHE_BYTES = 256 << 20;
+
+// Opens image for reading by rectangles, flags are the same as for cv::imread
+// (cv::IMREAD_COLOR gives CV_8UC3 BGR, cv::IMREAD_GRAYSCALE gives CV_8U).
+// Uncompressed TIFF files (both stripped and tiled) and label files (see LabelFile.h, grayscale only)
+// are memory mapped, other formats are decoded lazily as a whole. Returns empty pointer on failure.
+cv::Ptr<ImageSource> openImageSource(const std::string& filename, int flags = cv::IMREAD_COLOR,
+                                     size_t cacheBytes = DEFAULT_TILE_CACHE_BYTES);
+
+// The whole image scaled down factor times (sizes rounded up) band by band,
+// so only one band of a source read by tiles is decoded at a time.
+// cv::INTER_NEAREST keeps labels of markers and masks.
+cv::Mat readDownsampled(ImageSource& source, int factor, int interpolation = cv::INTER_AREA);
+
+#endif // IMAGE_SOURCE_H
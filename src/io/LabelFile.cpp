@@ -0,0 +1,409 @@
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "LabelFile.h"
+#include "Palette.h"
+
+namespace {
+
+const char MAGIC[4] = {'W', 'S', 'L', 'F'};
+const unsigned VERSION = 1;
+const unsigned FLAG_COLORED = 1;
+const size_t HEADER_SIZE = 28;
+// runs are stored in one byte as length - 1
+const int MAX_RUN = 256;
+
+void put32(std::vector<uchar>& out, unsigned value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back((uchar)(value >> (8 * i)));
+    }
+}
+
+void put64(std::vector<uchar>& out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+        out.push_back((uchar)(value >> (8 * i)));
+    }
+}
+
+unsigned get32(const uchar* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+uint64_t get64(const uchar* p) {
+    return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+class MappedLabelFile {
+public:
+    // Returns empty pointer if the file can't be mapped or its header and tile index are broken
+    static std::shared_ptr<MappedLabelFile> open(const std::string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return std::shared_ptr<MappedLabelFile>();
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < HEADER_SIZE) {
+            close(fd);
+            return std::shared_ptr<MappedLabelFile>();
+        }
+
+        const size_t fileSize = st.st_size;
+        void* mapped = mmap(0, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            return std::shared_ptr<MappedLabelFile>();
+        }
+
+        std::shared_ptr<MappedLabelFile> file(new MappedLabelFile((const uchar*)mapped, fileSize));
+        if (!file->parse()) {
+            return std::shared_ptr<MappedLabelFile>();
+        }
+        return file;
+    }
+
+    ~MappedLabelFile() {
+        munmap((void*)data_, size_);
+    }
+
+    const LabelFileInfo& info() const { return info_; }
+
+    int tilesCount() const { return (int)offsets_.size() - 1; }
+
+    cv::Rect tileRect(int index) const {
+        const int ts = info_.tileSize;
+        cv::Rect rect((index % tilesX_) * ts, (index / tilesX_) * ts, ts, ts);
+        return rect & cv::Rect(0, 0, info_.size.width, info_.size.height);
+    }
+
+    // dst has to have the size of tileRect(index)
+    bool decode(int index, cv::Mat& dst) const {
+        return decodeLabelRuns(data_ + offsets_[index], offsets_[index + 1] - offsets_[index], dst);
+    }
+
+private:
+    MappedLabelFile(const uchar* data, size_t size) : data_(data), size_(size), tilesX_(0) {}
+
+    bool parse() {
+        if (memcmp(data_, MAGIC, sizeof(MAGIC)) != 0 || get32(data_ + 4) != VERSION) {
+            return false;
+        }
+
+        const unsigned width = get32(data_ + 8), height = get32(data_ + 12);
+        const unsigned tileSize = get32(data_ + 16), flags = get32(data_ + 20);
+        const unsigned paletteSize = get32(data_ + 24);
+        if (width == 0 || height == 0 || width > INT_MAX || height > INT_MAX ||
+                tileSize == 0 || tileSize > INT_MAX || paletteSize > LABEL_COUNT) {
+            return false;
+        }
+
+        info_.size = cv::Size(width, height);
+        info_.tileSize = tileSize;
+        info_.colored = (flags & FLAG_COLORED) != 0;
+
+        size_t pos = HEADER_SIZE;
+        if (pos + paletteSize * 3 > size_) {
+            return false;
+        }
+        info_.palette.resize(paletteSize);
+        for (unsigned i = 0; i < paletteSize; ++i, pos += 3) {
+            info_.palette[i] = cv::Vec3b(data_[pos], data_[pos + 1], data_[pos + 2]);
+        }
+
+        // sizes are checked against the file size before anything is allocated for them:
+        // the offsets have to fit, and so do the tiles, a byte pair encodes at most 256 pixels of a row
+        tilesX_ = (int)((width + (uint64_t)tileSize - 1) / tileSize);
+        const uint64_t tiles = (uint64_t)tilesX_ * ((height + (uint64_t)tileSize - 1) / tileSize);
+        if (tiles >= INT_MAX || tiles + 1 > (size_ - pos) / 8) {
+            return false;
+        }
+        const uint64_t dataSize = size_ - pos - (tiles + 1) * 8;
+        if ((uint64_t)height * tilesX_ * 2 > dataSize || (uint64_t)width * height > dataSize * 128) {
+            return false;
+        }
+        offsets_.resize(tiles + 1);
+        for (size_t i = 0; i <= tiles; ++i, pos += 8) {
+            offsets_[i] = get64(data_ + pos);
+            if (offsets_[i] > size_ || (i > 0 && offsets_[i] < offsets_[i - 1])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const uchar* data_;
+    size_t size_;
+    LabelFileInfo info_;
+    int tilesX_;
+    std::vector<uint64_t> offsets_;
+};
+
+class LabelFileSource : public TiledImageSource {
+public:
+    LabelFileSource(const std::shared_ptr<MappedLabelFile>& file, size_t cacheBytes)
+        : TiledImageSource(file->info().size, CV_8U, cv::Size(file->info().tileSize, file->info().tileSize), cacheBytes)
+        , file_(file)
+    {
+    }
+
+protected:
+    void decodeTile(const cv::Rect& rect, cv::Mat& dst) {
+        const int tileSize = file_->info().tileSize;
+        const int tilesX = (size().width + tileSize - 1) / tileSize;
+        dst.create(rect.size(), CV_8U);
+        if (!file_->decode((rect.y / tileSize) * tilesX + rect.x / tileSize, dst)) {
+            std::cerr << "Corrupted label file tile at " << rect.x << ", " << rect.y << std::endl;
+            dst.setTo(cv::Scalar::all(0));
+        }
+    }
+
+private:
+    std::shared_ptr<MappedLabelFile> file_;
+};
+
+} // namespace
+
+void encodeLabelRuns(const cv::Mat& tile, std::vector<uchar>& out) {
+    for (int y = 0; y < tile.rows; ++y) {
+        const uchar* row = tile.ptr<uchar>(y);
+        for (int x = 0; x < tile.cols; ) {
+            const uchar label = row[x];
+            int run = 1;
+            while (x + run < tile.cols && run < MAX_RUN && row[x + run] == label) {
+                ++run;
+            }
+            out.push_back((uchar)(run - 1));
+            out.push_back(label);
+            x += run;
+        }
+    }
+}
+
+bool decodeLabelRuns(const uchar* data, size_t size, cv::Mat& dst) {
+    size_t pos = 0;
+    for (int y = 0; y < dst.rows; ++y) {
+        uchar* row = dst.ptr<uchar>(y);
+        for (int x = 0; x < dst.cols; ) {
+            if (pos + 2 > size) {
+                return false;
+            }
+            const int run = data[pos] + 1;
+            if (x + run > dst.cols) {
+                return false;
+            }
+            memset(row + x, data[pos + 1], run);
+            x += run;
+            pos += 2;
+        }
+    }
+    return pos == size;
+}
+
+bool writeLabelFile(const std::string& filename, const cv::Mat& labels, bool colored,
+                    const std::vector<cv::Vec3b>& palette, int tileSize) {
+    CV_Assert(labels.type() == CV_8U && palette.size() <= (size_t)LABEL_COUNT);
+    if (labels.empty()) {
+        std::cerr << "Can't write empty labels to " << filename << std::endl;
+        return false;
+    }
+    if (tileSize <= 0) {
+        tileSize = LABEL_FILE_TILE_SIZE;
+    }
+
+    const int tilesX = (labels.cols + tileSize - 1) / tileSize;
+    const int tilesY = (labels.rows + tileSize - 1) / tileSize;
+    const cv::Rect imageRect(0, 0, labels.cols, labels.rows);
+
+    std::vector<std::vector<uchar> > tiles(tilesX * tilesY);
+    cv::parallel_for_(cv::Range(0, (int)tiles.size()), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end; ++i) {
+            cv::Rect rect((i % tilesX) * tileSize, (i / tilesX) * tileSize, tileSize, tileSize);
+            encodeLabelRuns(labels(rect & imageRect), tiles[i]);
+        }
+    });
+
+    const cv::Vec3b* colors = palette.empty() ? labelColors() : &palette[0];
+    const size_t paletteSize = palette.empty() ? LABEL_COUNT : palette.size();
+
+    std::vector<uchar> header(MAGIC, MAGIC + sizeof(MAGIC));
+    put32(header, VERSION);
+    put32(header, labels.cols);
+    put32(header, labels.rows);
+    put32(header, tileSize);
+    put32(header, colored ? FLAG_COLORED : 0);
+    put32(header, (unsigned)paletteSize);
+    for (size_t i = 0; i < paletteSize; ++i) {
+        header.insert(header.end(), colors[i].val, colors[i].val + 3);
+    }
+
+    uint64_t offset = header.size() + (tiles.size() + 1) * 8;
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        put64(header, offset);
+        offset += tiles[i].size();
+    }
+    put64(header, offset);
+
+    std::ofstream out(filename.c_str(), std::ios::binary);
+    out.write((const char*)&header[0], header.size());
+    for (size_t i = 0; i < tiles.size() && out; ++i) {
+        out.write((const char*)&tiles[i][0], tiles[i].size());
+    }
+    if (!out) {
+        std::cerr << "Can't write label file " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+cv::Mat readLabelFile(const std::string& filename, LabelFileInfo* info) {
+    std::shared_ptr<MappedLabelFile> file = MappedLabelFile::open(filename);
+    if (!file) {
+        std::cerr << "Can't read label file " << filename << std::endl;
+        return cv::Mat();
+    }
+
+    cv::Mat labels(file->info().size, CV_8U);
+    std::atomic<bool> ok(true);
+    cv::parallel_for_(cv::Range(0, file->tilesCount()), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end && ok; ++i) {
+            cv::Mat tile = labels(file->tileRect(i));
+            if (!file->decode(i, tile)) {
+                ok = false;
+            }
+        }
+    });
+    if (!ok) {
+        std::cerr << "Corrupted label file " << filename << std::endl;
+        return cv::Mat();
+    }
+
+    if (info) {
+        *info = file->info();
+    }
+    return labels;
+}
+
+bool isLabelFile(const std::string& filename) {
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    char magic[sizeof(MAGIC)];
+    return in.read(magic, sizeof(magic)) && memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+cv::Ptr<ImageSource> openLabelFileSource(const std::string& filename, size_t cacheBytes) {
+    std::shared_ptr<MappedLabelFile> file = MappedLabelFile::open(filename);
+    if (!file) {
+        return cv::Ptr<ImageSource>();
+    }
+    return cv::Ptr<ImageSource>(new LabelFileSource(file, cacheBytes));
+}
+
+bool pngToLabelFile(const std::string& pngFilename, const std::string& filename) {
+    cv::Mat img = cv::imread(pngFilename, cv::IMREAD_UNCHANGED);
+    if (img.empty() || img.depth() != CV_8U) {
+        std::cerr << "Can't read " << pngFilename << " as 8 bit image" << std::endl;
+        return false;
+    }
+
+    if (img.channels() == 1) {
+        return writeLabelFile(filename, img, false);
+    }
+
+    if (img.channels() == 4) {
+        std::vector<cv::Mat> channels;
+        cv::split(img, channels);
+        double minAlpha;
+        cv::minMaxLoc(channels[3], &minAlpha);
+        if (minAlpha < 255) {
+            std::cerr << pngFilename << " is transparent, label file can't keep alpha, not converted" << std::endl;
+            return false;
+        }
+        cv::cvtColor(img, img, cv::COLOR_BGRA2BGR);
+    }
+    cv::Mat labels;
+    if (!labelsFromColors(img, labels)) {
+        std::cerr << pngFilename << " has a region touching regions of all " << REGION_LABEL_COUNT
+                  << " region labels, not converted" << std::endl;
+        return false;
+    }
+
+    // colors of other palettes got region labels, keep them so the PNG can be restored as it was
+    std::vector<cv::Vec3b> palette(labelColors(), labelColors() + LABEL_COUNT);
+    std::vector<bool> seen(LABEL_COUNT, false);
+    for (int i = 0; i < labels.rows; ++i) {
+        const uchar* label = labels.ptr<uchar>(i);
+        const cv::Vec3b* color = img.ptr<cv::Vec3b>(i);
+        for (int j = 0; j < labels.cols; ++j) {
+            if (label[j] >= firstRegionLabel && !seen[label[j]]) {
+                seen[label[j]] = true;
+                palette[label[j]] = color[j];
+            }
+        }
+    }
+
+    // Foreign colors share region labels after REGION_LABEL_COUNT of them, and a foreign color
+    // can get the region label of a palette color elsewhere, then one label stands for several colors.
+    // A file which can't restore the PNG isn't written.
+    std::atomic<bool> lossless(true);
+    cv::parallel_for_(cv::Range(0, labels.rows), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end && lossless; ++i) {
+            const uchar* label = labels.ptr<uchar>(i);
+            const cv::Vec3b* color = img.ptr<cv::Vec3b>(i);
+            for (int j = 0; j < labels.cols; ++j) {
+                if (palette[label[j]] != color[j]) {
+                    lossless = false;
+                    break;
+                }
+            }
+        }
+    });
+    if (!lossless) {
+        std::cerr << pngFilename << " has colors which label file can't keep apart (more than "
+                  << REGION_LABEL_COUNT << " colors which are not in the palette, or some of them are "
+                  << "the same as region label colors), not converted" << std::endl;
+        return false;
+    }
+
+    return writeLabelFile(filename, labels, true, palette);
+}
+
+bool labelFileToPng(const std::string& filename, const std::string& pngFilename) {
+    LabelFileInfo info;
+    cv::Mat labels = readLabelFile(filename, &info);
+    if (labels.empty()) {
+        return false;
+    }
+
+    cv::Mat png = labels;
+    if (info.colored) {
+        std::vector<cv::Vec3b> palette(info.palette);
+        palette.resize(LABEL_COUNT, cv::Vec3b(0, 0, 0));
+
+        png.create(labels.size(), CV_8UC3);
+        cv::parallel_for_(cv::Range(0, labels.rows), [&](const cv::Range& range) {
+            for (int i = range.start; i < range.end; ++i) {
+                const uchar* src = labels.ptr<uchar>(i);
+                cv::Vec3b* dst = png.ptr<cv::Vec3b>(i);
+                for (int j = 0; j < labels.cols; ++j) {
+                    dst[j] = palette[src[j]];
+                }
+            }
+        });
+    }
+
+    if (!cv::imwrite(pngFilename, png)) {
+        std::cerr << "Can't write " << pngFilename << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,57 @@
+#ifndef LABEL_FILE_H
+#define LABEL_FILE_H
+
+#include "opencv2/imgproc.hpp"
+
+#include <string>
+#include <vector>
+
+#include "ImageSource.h"
+
+// Native format of label images (masks and markers), little endian:
+//   "WSLF", version, width, height, tile size, flags, palette size (all uint32),
+//   palette (BGR per label),
+//   tiles count + 1 uint64 offsets of tiles from the file start (the last one is the file end),
+//   tiles in row-major order, every row of a tile is a sequence of (run length - 1, label) byte pairs.
+// Tiles are independent, so they are encoded and decoded in parallel and read one by one from a mapped file.
+
+const int LABEL_FILE_TILE_SIZE = 256;
+
+struct LabelFileInfo {
+    LabelFileInfo() : tileSize(0), colored(false) {}
+
+    cv::Size size;
+    int tileSize;
+    // the PNG counterpart of the file is a BGR mask (colored with palette), otherwise a grayscale image
+    bool colored;
+    std::vector<cv::Vec3b> palette;
+};
+
+// Writes labels (CV_8U), palette is labelColors() if not given
+bool writeLabelFile(const std::string& filename, const cv::Mat& labels, bool colored,
+                    const std::vector<cv::Vec3b>& palette = std::vector<cv::Vec3b>(),
+                    int tileSize = LABEL_FILE_TILE_SIZE);
+
+// Returns empty Mat if the file can't be read
+cv::Mat readLabelFile(const std::string& filename, LabelFileInfo* info = 0);
+
+bool isLabelFile(const std::string& filename);
+
+// Run-length coding of label files tiles: (run length - 1, label) byte pairs for every row of tile (CV_8U).
+// Decoding fails if data doesn't match the size of tile exactly.
+void encodeLabelRuns(const cv::Mat& tile, std::vector<uchar>& out);
+bool decodeLabelRuns(const uchar* data, size_t size, cv::Mat& tile);
+
+// Tiles of the memory mapped file decoded on demand (CV_8U),
+// returns empty pointer if the file is not a label file
+cv::Ptr<ImageSource> openLabelFileSource(const std::string& filename, size_t cacheBytes = DEFAULT_TILE_CACHE_BYTES);
+
+// Lossless conversion from / to the PNG files masks and markers are saved as.
+// BGR PNG becomes a colored file which keeps its colors in the palette,
+// grayscale PNG becomes a file with the same labels.
+// PNG which can't be restored exactly (more than REGION_LABEL_COUNT colors which are not in labelColors(),
+// or transparency) isn't converted, pngToLabelFile fails then.
+bool pngToLabelFile(const std::string& pngFilename, const std::string& filename);
+bool labelFileToPng(const std::string& filename, const std::string& pngFilename);
+
+#endif // LABEL_FILE_H
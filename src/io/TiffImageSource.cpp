@@ -0,0 +1,276 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "TiffImageSource.h"
+
+namespace {
+
+enum TiffTag {
+    IMAGE_WIDTH = 256,
+    IMAGE_LENGTH = 257,
+    BITS_PER_SAMPLE = 258,
+    COMPRESSION = 259,
+    PHOTOMETRIC = 262,
+    STRIP_OFFSETS = 273,
+    SAMPLES_PER_PIXEL = 277,
+    ROWS_PER_STRIP = 278,
+    PLANAR_CONFIG = 284,
+    TILE_WIDTH = 322,
+    TILE_LENGTH = 323,
+    TILE_OFFSETS = 324
+};
+
+enum TiffType {
+    TIFF_BYTE = 1,
+    TIFF_SHORT = 3,
+    TIFF_LONG = 4
+};
+
+// size of stripes used as cache tiles for images without TIFF tiles
+const int STRIPPED_CACHE_TILE = 512;
+
+class TiffReader {
+public:
+    TiffReader(const uchar* data, size_t size) : data_(data), size_(size), bigEndian_(false) {}
+
+    bool parseHeader(size_t& ifdOffset) {
+        if (size_ < 8) {
+            return false;
+        }
+        if (data_[0] == 'I' && data_[1] == 'I') {
+            bigEndian_ = false;
+        } else if (data_[0] == 'M' && data_[1] == 'M') {
+            bigEndian_ = true;
+        } else {
+            return false;
+        }
+        if (u16(2) != 42) {
+            return false;
+        }
+        ifdOffset = u32(4);
+        return ifdOffset + 2 <= size_;
+    }
+
+    unsigned u16(size_t offset) const {
+        return bigEndian_ ? (data_[offset] << 8) | data_[offset + 1]
+                          : data_[offset] | (data_[offset + 1] << 8);
+    }
+
+    unsigned u32(size_t offset) const {
+        return bigEndian_ ? ((unsigned)u16(offset) << 16) | u16(offset + 2)
+                          : u16(offset) | ((unsigned)u16(offset + 2) << 16);
+    }
+
+    // values of IFD entry which starts at offset
+    bool values(size_t entry, std::vector<unsigned>& result) const {
+        unsigned type = u16(entry + 2);
+        unsigned count = u32(entry + 4);
+        size_t typeSize = type == TIFF_SHORT ? 2 : type == TIFF_LONG ? 4 : type == TIFF_BYTE ? 1 : 0;
+        if (typeSize == 0 || count == 0) {
+            return false;
+        }
+
+        size_t offset = count * typeSize <= 4 ? entry + 8 : u32(entry + 8);
+        if (offset + count * typeSize > size_) {
+            return false;
+        }
+
+        result.resize(count);
+        for (unsigned i = 0; i < count; ++i) {
+            size_t at = offset + i * typeSize;
+            result[i] = typeSize == 2 ? u16(at) : typeSize == 4 ? u32(at) : data_[at];
+        }
+        return true;
+    }
+
+    // first value of a scalar tag, result is left as it is if the entry can't be read
+    bool value(size_t entry, unsigned& result) const {
+        std::vector<unsigned> read;
+        if (!values(entry, read)) {
+            return false;
+        }
+        result = read[0];
+        return true;
+    }
+
+private:
+    const uchar* data_;
+    size_t size_;
+    bool bigEndian_;
+};
+
+class TiffImageSource : public TiledImageSource {
+public:
+    TiffImageSource(const uchar* data, size_t dataSize, cv::Size size, int type, cv::Size cacheTile, size_t cacheBytes,
+                    int samplesPerPixel, cv::Size chunkSize, const std::vector<unsigned>& chunkOffsets)
+        : TiledImageSource(size, type, cacheTile, cacheBytes)
+        , data_(data)
+        , dataSize_(dataSize)
+        , samplesPerPixel_(samplesPerPixel)
+        , chunkSize_(chunkSize)
+        , chunksX_((size.width + chunkSize.width - 1) / chunkSize.width)
+        , chunkOffsets_(chunkOffsets)
+    {
+    }
+
+    ~TiffImageSource() {
+        munmap((void*)data_, dataSize_);
+    }
+
+protected:
+    void decodeTile(const cv::Rect& rect, cv::Mat& dst) {
+        dst.create(rect.size(), type());
+        const int dstChannels = dst.channels();
+
+        for (int y = rect.y; y < rect.y + rect.height; ++y) {
+            uchar* dstRow = dst.ptr<uchar>(y - rect.y);
+
+            // a row of the cache tile may span several TIFF tiles
+            for (int x = rect.x; x < rect.x + rect.width; ) {
+                const int cx = x / chunkSize_.width, cy = y / chunkSize_.height;
+                const int xEnd = std::min(rect.x + rect.width, (cx + 1) * chunkSize_.width);
+
+                const size_t rowBytes = (size_t)chunkSize_.width * samplesPerPixel_;
+                const uchar* src = data_ + chunkOffsets_[cy * chunksX_ + cx]
+                        + (y - cy * chunkSize_.height) * rowBytes
+                        + (x - cx * chunkSize_.width) * samplesPerPixel_;
+
+                convertPixels(src, dstRow + (x - rect.x) * dstChannels, dstChannels, xEnd - x);
+                x = xEnd;
+            }
+        }
+    }
+
+private:
+    void convertPixels(const uchar* src, uchar* dst, int dstChannels, int count) const {
+        const int spp = samplesPerPixel_;
+        if (spp == 1) {
+            for (int i = 0; i < count; ++i) {
+                for (int c = 0; c < dstChannels; ++c) {
+                    *dst++ = src[i];
+                }
+            }
+        } else if (dstChannels == 3) {
+            // RGB -> BGR
+            for (int i = 0; i < count; ++i, src += spp, dst += 3) {
+                dst[0] = src[2];
+                dst[1] = src[1];
+                dst[2] = src[0];
+            }
+        } else {
+            // the same fixed point coefficients cv::cvtColor uses
+            for (int i = 0; i < count; ++i, src += spp) {
+                *dst++ = (uchar)((src[0] * 4899 + src[1] * 9617 + src[2] * 1868 + (1 << 13)) >> 14);
+            }
+        }
+    }
+
+    const uchar* data_;
+    size_t dataSize_;
+    int samplesPerPixel_;
+    // TIFF strip (full width) or tile
+    cv::Size chunkSize_;
+    int chunksX_;
+    std::vector<unsigned> chunkOffsets_;
+};
+
+} // namespace
+
+cv::Ptr<ImageSource> openTiffImageSource(const std::string& filename, int flags, size_t cacheBytes) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return cv::Ptr<ImageSource>();
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 8) {
+        close(fd);
+        return cv::Ptr<ImageSource>();
+    }
+
+    const size_t fileSize = st.st_size;
+    void* mapped = mmap(0, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return cv::Ptr<ImageSource>();
+    }
+
+    const uchar* data = (const uchar*)mapped;
+    TiffReader reader(data, fileSize);
+
+    size_t ifd = 0;
+    bool ok = reader.parseHeader(ifd);
+
+    unsigned width = 0, height = 0, compression = 1, photometric = 2, spp = 1, rowsPerStrip = 0;
+    unsigned planar = 1, tileWidth = 0, tileLength = 0;
+    std::vector<unsigned> bitsPerSample, offsets, tileOffsets;
+
+    const unsigned entries = ok ? reader.u16(ifd) : 0;
+    ok = ok && ifd + 2 + entries * 12 <= fileSize;
+    for (unsigned i = 0; ok && i < entries; ++i) {
+        const size_t entry = ifd + 2 + i * 12;
+        const unsigned tag = reader.u16(entry);
+        switch (tag) {
+        case IMAGE_WIDTH: ok = reader.value(entry, width); break;
+        case IMAGE_LENGTH: ok = reader.value(entry, height); break;
+        case BITS_PER_SAMPLE: ok = reader.values(entry, bitsPerSample); break;
+        case COMPRESSION: ok = reader.value(entry, compression); break;
+        case PHOTOMETRIC: ok = reader.value(entry, photometric); break;
+        case STRIP_OFFSETS: ok = reader.values(entry, offsets); break;
+        case SAMPLES_PER_PIXEL: ok = reader.value(entry, spp); break;
+        case ROWS_PER_STRIP: ok = reader.value(entry, rowsPerStrip); break;
+        case PLANAR_CONFIG: ok = reader.value(entry, planar); break;
+        case TILE_WIDTH: ok = reader.value(entry, tileWidth); break;
+        case TILE_LENGTH: ok = reader.value(entry, tileLength); break;
+        case TILE_OFFSETS: ok = reader.values(entry, tileOffsets); break;
+        default: break;
+        }
+    }
+
+    // only what can be read straight from the file
+    ok = ok && width > 0 && height > 0 && compression == 1 && planar == 1 &&
+            (spp == 1 || spp == 3 || spp == 4) && (photometric == 1 || photometric == 2);
+    for (size_t i = 0; ok && i < bitsPerSample.size(); ++i) {
+        ok = bitsPerSample[i] == 8;
+    }
+
+    const bool tiled = !tileOffsets.empty();
+    cv::Size chunkSize;
+    cv::Size cacheTile;
+    if (ok && tiled) {
+        ok = tileWidth > 0 && tileLength > 0;
+        chunkSize = cv::Size(tileWidth, tileLength);
+        cacheTile = chunkSize;
+        offsets.swap(tileOffsets);
+    } else if (ok) {
+        if (rowsPerStrip == 0 || rowsPerStrip > height) {
+            rowsPerStrip = height;
+        }
+        chunkSize = cv::Size(width, rowsPerStrip);
+        cacheTile = cv::Size(STRIPPED_CACHE_TILE, STRIPPED_CACHE_TILE);
+    }
+
+    if (ok) {
+        const size_t chunksX = (width + chunkSize.width - 1) / chunkSize.width;
+        const size_t chunksY = (height + chunkSize.height - 1) / chunkSize.height;
+        const size_t chunkBytes = (size_t)chunkSize.width * chunkSize.height * spp;
+        ok = offsets.size() >= chunksX * chunksY;
+        for (size_t i = 0; ok && i < chunksX * chunksY; ++i) {
+            // TIFF tiles are padded to full size, but the last strip may be shorter
+            size_t rows = std::min<size_t>(chunkSize.height, height - (i / chunksX) * chunkSize.height);
+            size_t needed = tiled ? chunkBytes : rows * chunkSize.width * spp;
+            ok = offsets[i] + needed <= fileSize;
+        }
+    }
+
+    if (!ok) {
+        munmap(mapped, fileSize);
+        return cv::Ptr<ImageSource>();
+    }
+
+    const int type = flags == cv::IMREAD_GRAYSCALE ? CV_8U : CV_8UC3;
+    return cv::Ptr<ImageSource>(new TiffImageSource(data, fileSize, cv::Size(width, height), type, cacheTile, cacheBytes,
+                                                    spp, chunkSize, offsets));
+}
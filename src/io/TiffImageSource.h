@@ -0,0 +1,11 @@
+#ifndef TIFF_IMAGE_SOURCE_H
+#define TIFF_IMAGE_SOURCE_H
+
+#include "ImageSource.h"
+
+// Memory mapped baseline TIFF: uncompressed, 8 bits per sample,
+// gray or RGB(A), stripped or tiled. Cache tiles follow TIFF tiles when there are any.
+// Returns empty pointer if the file is not such a TIFF.
+cv::Ptr<ImageSource> openTiffImageSource(const std::string& filename, int flags, size_t cacheBytes);
+
+#endif // TIFF_IMAGE_SOURCE_H
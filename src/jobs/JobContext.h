@@ -0,0 +1,26 @@
+#ifndef JOB_CONTEXT_H
+#define JOB_CONTEXT_H
+
+#include <atomic>
+
+// What a running job sees: cancellation request and a place to report progress.
+// Kernels which run inside jobs take it without depending on JobRunner.
+class JobContext {
+public:
+    JobContext() : cancelled_(false), progress_(0) {}
+
+    // Jobs check it between stages and return as soon as it's set
+    bool cancelled() const { return cancelled_; }
+
+    // fraction of work done, [0, 1]
+    void setProgress(double progress) { progress_ = progress; }
+    double progress() const { return progress_; }
+
+    void cancel() { cancelled_ = true; }
+
+private:
+    std::atomic<bool> cancelled_;
+    std::atomic<double> progress_;
+};
+
+#endif // JOB_CONTEXT_H
@@ -0,0 +1,96 @@
+#include "opencv2/core/utility.hpp"
+
+#include <iostream>
+
+#include "JobRunner.h"
+
+namespace {
+
+// progress is printed in steps, not on every update
+const double PROGRESS_STEP = 0.1;
+
+} // namespace
+
+JobRunner::~JobRunner() {
+    shutdown();
+}
+
+void JobRunner::shutdown() {
+    cancel();
+    for (size_t i = 0; i < retired_.size(); ++i) {
+        retired_[i]->thread.join();
+    }
+    retired_.clear();
+}
+
+void JobRunner::start(const std::string& name, Work work, Done onDone) {
+    if (current_) {
+        std::cout << current_->name << " is superseded by " << name << std::endl;
+        retire();
+    }
+
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->name = name;
+    job->onDone = onDone;
+    job->startTicks = (double)cv::getTickCount();
+
+    Job* jobPtr = job.get();
+    job->thread = std::thread([jobPtr, work]() {
+        jobPtr->ok = work(jobPtr->context) && !jobPtr->context.cancelled();
+        jobPtr->finished = true;
+    });
+
+    current_ = job;
+    std::cout << name << " started" << std::endl;
+}
+
+void JobRunner::cancel() {
+    if (current_) {
+        std::cout << current_->name << " cancelled" << std::endl;
+        retire();
+    }
+}
+
+void JobRunner::retire() {
+    current_->context.cancel();
+    retired_.push_back(current_);
+    current_.reset();
+}
+
+void JobRunner::poll() {
+    for (size_t i = 0; i < retired_.size(); ) {
+        if (retired_[i]->finished) {
+            retired_[i]->thread.join();
+            retired_.erase(retired_.begin() + i);
+        } else {
+            ++i;
+        }
+    }
+
+    if (!current_) {
+        return;
+    }
+
+    Job& job = *current_;
+    if (!job.finished) {
+        double progress = job.context.progress();
+        if (progress >= job.reportedProgress + PROGRESS_STEP) {
+            job.reportedProgress = progress;
+            std::cout << job.name << ": " << (int)(progress * 100) << "%" << std::endl;
+        }
+        return;
+    }
+
+    job.thread.join();
+    // the job is done, whatever onDone does (even starting another job) it's not current anymore
+    std::shared_ptr<Job> finished = current_;
+    current_.reset();
+
+    double ms = ((double)cv::getTickCount() - finished->startTicks) * 1000. / cv::getTickFrequency();
+    if (finished->ok) {
+        std::cout << finished->name << " finished in " << ms << "ms" << std::endl;
+        finished->onDone();
+    } else {
+        std::cerr << finished->name << " failed" << std::endl;
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef JOB_RUNNER_H
+#define JOB_RUNNER_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "JobContext.h"
+
+// Runs long UI operations on background threads, one at a time from the UI point of view:
+// starting a job supersedes (cancels and forgets) the one in flight instead of queuing behind it.
+// Jobs work on their own copies of the data and hand results over in onDone,
+// which is called on the UI thread from poll(), so the UI keeps showing the last valid result.
+class JobRunner {
+public:
+    // returns false if the job was cancelled or failed, onDone isn't called then
+    typedef std::function<bool(JobContext&)> Work;
+    typedef std::function<void()> Done;
+
+    ~JobRunner();
+
+    void start(const std::string& name, Work work, Done onDone);
+
+    // cancels the current job, its result is dropped
+    void cancel();
+
+    // cancels the current job and waits for all job threads to finish,
+    // has to be called before the data jobs refer to goes away
+    void shutdown();
+
+    // there is a job whose result isn't delivered yet
+    bool busy() const { return (bool)current_; }
+
+    // Has to be called regularly from the UI thread: prints progress of the current job,
+    // delivers its result when it's finished and joins threads of superseded jobs
+    void poll();
+
+private:
+    struct Job {
+        Job() : finished(false), ok(false), reportedProgress(0) {}
+
+        std::string name;
+        JobContext context;
+        Done onDone;
+        std::atomic<bool> finished;
+        bool ok;
+        double startTicks;
+        double reportedProgress;
+        std::thread thread;
+    };
+
+    void retire();
+
+    std::shared_ptr<Job> current_;
+    std::vector<std::shared_ptr<Job> > retired_;
+};
+
+#endif // JOB_RUNNER_H
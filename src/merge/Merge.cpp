@@ -0,0 +1,120 @@
+#include <opencv2/core/utility.hpp>
+
+#include <iostream>
+#include <sstream>
+
+#include "Merge.h"
+#include "Trace.h"
+
+namespace {
+
+const uchar NO_SOURCE = 255;
+
+} // namespace
+
+MergeSource::MergeSource(const cv::Mat& mask, const std::string& name) : mask(mask), name(name) {
+    provides.set();
+    provides.reset(notSpecifiedLabel);
+}
+
+std::vector<size_t> mergeMasks(const std::vector<MergeSource>& sources, cv::Mat& dst) {
+    TRACE_SCOPE("merge");
+    if (sources.empty()) {
+        return std::vector<size_t>();
+    }
+    CV_Assert(sources.size() < NO_SOURCE);
+
+    const cv::Size size = sources[0].mask.size();
+    for (size_t k = 0; k < sources.size(); ++k) {
+        if (sources[k].mask.size() != size) {
+            std::cerr << "Can't merge masks, incompatible sizes" << std::endl;
+            return std::vector<size_t>();
+        }
+        CV_Assert(sources[k].mask.type() == CV_8U);
+    }
+    dst.create(size, CV_8U);
+
+    // per source lookup tables: label provided, label chosen so far overridden
+    const int n = (int)sources.size();
+    std::vector<uchar> provides((size_t)n * LABEL_COUNT), overrides((size_t)n * LABEL_COUNT);
+    for (int k = 0; k < n; ++k) {
+        for (int l = 0; l < LABEL_COUNT; ++l) {
+            provides[(size_t)k * LABEL_COUNT + l] = sources[k].provides[l] ? 1 : 0;
+            overrides[(size_t)k * LABEL_COUNT + l] = sources[k].overrides[l] ? 1 : 0;
+        }
+    }
+
+    // partial counts per stripe, summed in stripe order
+    const int stripes = std::max(1, std::min(size.height, cv::getNumThreads()));
+    std::vector<size_t> partial((size_t)stripes * n, 0);
+
+    cv::parallel_for_(cv::Range(0, stripes), [&](const cv::Range& range) {
+        std::vector<const uchar*> rows(n);
+        std::vector<uchar> owner(size.width);
+        for (int stripe = range.start; stripe < range.end; ++stripe) {
+            size_t* counts = &partial[(size_t)stripe * n];
+            const int y0 = (int)((int64_t)size.height * stripe / stripes);
+            const int y1 = (int)((int64_t)size.height * (stripe + 1) / stripes);
+            for (int y = y0; y < y1; ++y) {
+                for (int k = 0; k < n; ++k) {
+                    rows[k] = sources[k].mask.ptr<uchar>(y);
+                }
+                uchar* out = dst.ptr<uchar>(y);
+
+                // the first source is taken as is, every next one is applied over the whole row
+                const uchar* first = rows[0];
+                const uchar* firstProvides = &provides[0];
+                for (int x = 0; x < size.width; ++x) {
+                    const uchar label = first[x];
+                    const uchar taken = firstProvides[label];
+                    out[x] = taken ? label : notSpecifiedLabel;
+                    owner[x] = taken ? 0 : NO_SOURCE;
+                }
+                for (int k = 1; k < n; ++k) {
+                    const uchar* src = rows[k];
+                    const uchar* kProvides = &provides[(size_t)k * LABEL_COUNT];
+                    const uchar* kOverrides = &overrides[(size_t)k * LABEL_COUNT];
+                    for (int x = 0; x < size.width; ++x) {
+                        const uchar label = src[x];
+                        const uchar take = kProvides[label] & (uchar)(owner[x] == NO_SOURCE || kOverrides[out[x]]);
+                        out[x] = take ? label : out[x];
+                        owner[x] = take ? (uchar)k : owner[x];
+                    }
+                }
+
+                for (int x = 0; x < size.width; ++x) {
+                    if (owner[x] != NO_SOURCE) {
+                        counts[owner[x]]++;
+                    }
+                }
+            }
+        }
+    });
+
+    std::vector<size_t> contributed(n, 0);
+    for (int stripe = 0; stripe < stripes; ++stripe) {
+        for (int k = 0; k < n; ++k) {
+            contributed[k] += partial[(size_t)stripe * n + k];
+        }
+    }
+    return contributed;
+}
+
+std::string mergeReport(const std::vector<MergeSource>& sources, const std::vector<size_t>& contributed) {
+    std::ostringstream report;
+    report << "Merged pixels:";
+    for (size_t k = 0; k < contributed.size() && k < sources.size(); ++k) {
+        report << (k ? ", " : " ") << contributed[k] << " from "
+               << (sources[k].name.empty() ? "source " + std::to_string(k + 1) : sources[k].name);
+    }
+    return report.str();
+}
+
+void mergeMasks(cv::Mat& src, const cv::Mat& dst) {
+    std::vector<MergeSource> sources;
+    sources.push_back(MergeSource(src));
+    sources.push_back(MergeSource(dst));
+    // not-specified pixels of dst stay not specified
+    sources.back().provides.set();
+    mergeMasks(sources, src);
+}
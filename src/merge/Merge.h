@@ -0,0 +1,41 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include "opencv2/imgproc.hpp"
+
+#include <bitset>
+#include <string>
+#include <vector>
+
+#include "Palette.h"
+
+typedef std::bitset<LABEL_COUNT> MergeLabels;
+
+// One mask (CV_8U labels) taking part in a merge
+struct MergeSource {
+    // provides every label except "not specified" and overrides nothing
+    MergeSource(const cv::Mat& mask, const std::string& name = std::string());
+
+    cv::Mat mask;
+    std::string name;
+    // labels this source provides, pixels with other labels are left to other sources
+    MergeLabels provides;
+    // labels set by higher priority sources which this source replaces
+    MergeLabels overrides;
+};
+
+// Resolves sources in one row-parallel pass, sources are given in priority order.
+// A pixel gets the label of the first source providing it, unless a later source
+// providing its own label there overrides the label chosen so far.
+// Pixels no source provides are not specified.
+// dst may be the mask of the first source.
+// Returns how many pixels of dst each source contributed (empty if sizes don't match).
+std::vector<size_t> mergeMasks(const std::vector<MergeSource>& sources, cv::Mat& dst);
+
+// "Merged pixels: N from <name>, ..." for the counts mergeMasks returned
+std::string mergeReport(const std::vector<MergeSource>& sources, const std::vector<size_t>& contributed);
+
+// Fills every not-specified pixel of src with the corresponding label of dst
+void mergeMasks(cv::Mat& src, const cv::Mat& dst);
+
+#endif // MERGE_H
@@ -0,0 +1,33 @@
+#include "Pipeline.h"
+#include "Watershed.h"
+#include "HueThreshold.h"
+#include "Merge.h"
+#include "Filter.h"
+#include "TiledPipeline.h"
+#include "Trace.h"
+
+cv::Mat runPipeline(const cv::Mat& img0, const cv::Mat& markerMask,
+                    const LabelSet& validLabels,
+                    const PipelineOptions& options) {
+    if (options.tiled) {
+        return runTiledPipeline(img0, markerMask, validLabels, options, options.tiles);
+    }
+
+    TRACE_SCOPE("pipeline");
+
+    cv::Mat mask = runWatershed(img0, markerMask, options.watershed);
+    if (mask.empty()) {
+        return mask;
+    }
+
+    cv::Mat thresholdMask = runThresholdBasedMethod(img0);
+    mergeMasks(mask, thresholdMask);
+
+    if (options.filterMode == SLIDING_FILTER) {
+        slidingModeFilter(mask, validLabels, options.filterWinSize / 2);
+    } else {
+        invalidColorFilter(mask, validLabels, options.filterWinSize);
+    }
+
+    return mask;
+}
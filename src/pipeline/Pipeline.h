@@ -0,0 +1,55 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "opencv2/imgproc.hpp"
+
+#include "Palette.h"
+#include "ParallelWatershed.h"
+
+enum FilterMode {
+    // invalidColorFilter, non-overlapping winSize blocks
+    BLOCK_FILTER,
+    // slidingModeFilter, window of winSize centered on every pixel
+    SLIDING_FILTER
+};
+
+struct TileOptions {
+    TileOptions() : tileSize(0), halo(64), memoryBudgetMB(1024), validate(false) {}
+
+    // side of the tile core, 0 means pick the largest tile which fits into memory budget
+    int tileSize;
+    // Context around the core every tile is processed with. Morphology and filter windows near
+    // the core edges are the same as for the whole image. Watershed is the same only where basins
+    // and the seeds flooding them are within the halo: a tile floods from the seeds of its core and halo
+    // (the halo of a tile without seeds is doubled until some are found while the tile fits into its share
+    // of memory budget, otherwise its core is unknown), so a basin wider than the halo
+    // can be split differently, and region labels are picked per tile, so the same region can have
+    // different labels on both sides of a tile edge. Classes don't depend on tiles.
+    int halo;
+    // upper bound for temporary buffers of all tiles processed at the same time
+    size_t memoryBudgetMB;
+    // runs the whole image pipeline too and reports how well the tiled result agrees with it
+    // (needs the whole image in memory)
+    bool validate;
+};
+
+struct PipelineOptions {
+    PipelineOptions() : filterMode(BLOCK_FILTER), filterWinSize(10), tiled(false) {}
+
+    WatershedOptions watershed;
+    FilterMode filterMode;
+    int filterWinSize;
+
+    // process image tile by tile (see runTiledPipeline), for scenes which don't fit into memory
+    bool tiled;
+    TileOptions tiles;
+};
+
+// Runs the whole non-interactive chain on one image:
+// watershed -> hue threshold merge -> invalid color filter.
+// Returns CV_8U label mask or an empty mask if there are no markers to grow regions from.
+cv::Mat runPipeline(const cv::Mat& img0, const cv::Mat& markerMask,
+                    const LabelSet& validLabels,
+                    const PipelineOptions& options = PipelineOptions());
+
+#endif // PIPELINE_H
@@ -0,0 +1,220 @@
+#include "opencv2/core/utility.hpp"
+
+#include <cmath>
+#include <atomic>
+#include <mutex>
+#include <iostream>
+
+#include "TiledPipeline.h"
+#include "Watershed.h"
+#include "HueThreshold.h"
+#include "Merge.h"
+#include "Filter.h"
+#include "Trace.h"
+
+namespace {
+
+// Rough upper bound of temporary bytes per tile pixel: HSV + hue + threshold (5),
+// watershed markers and cv::watershed queues (8), contours copy, labels and filter copy (3)
+const size_t TILE_BYTES_PER_PIXEL = 16;
+
+const int MIN_TILE_SIZE = 256;
+
+int roundUp(int value, int step) {
+    return (value + step - 1) / step * step;
+}
+
+int pickTileSize(const TileOptions& tileOptions, int halo, int winSize, int concurrency) {
+    int tileSize = tileOptions.tileSize;
+    if (tileSize <= 0) {
+        double pixelsPerTile = tileOptions.memoryBudgetMB * 1024. * 1024. / TILE_BYTES_PER_PIXEL / concurrency;
+        tileSize = std::max(MIN_TILE_SIZE, (int)std::sqrt(pixelsPerTile) - 2 * halo);
+    }
+
+    // filter windows have to be aligned with the whole image grid
+    return std::max(winSize, tileSize / winSize * winSize);
+}
+
+inline cv::Rect inflate(const cv::Rect& rect, int d) {
+    return cv::Rect(rect.x - d, rect.y - d, rect.width + 2 * d, rect.height + 2 * d);
+}
+
+// Fractions of pixels with the same label and with the same class,
+// all region labels count as one class there, as they are picked per tile
+void maskAgreement(const cv::Mat& mask1, const cv::Mat& mask2, double& sameLabel, double& sameClass) {
+    CV_Assert(mask1.size() == mask2.size() && mask1.type() == CV_8U && mask2.type() == CV_8U);
+
+    size_t labels = 0, classes = 0;
+    for (int i = 0; i < mask1.rows; ++i) {
+        const uchar* row1 = mask1.ptr<uchar>(i);
+        const uchar* row2 = mask2.ptr<uchar>(i);
+        for (int j = 0; j < mask1.cols; ++j) {
+            labels += row1[j] == row2[j];
+            classes += std::min(row1[j], firstRegionLabel) == std::min(row2[j], firstRegionLabel);
+        }
+    }
+    const double total = std::max(1., (double)mask1.total());
+    sameLabel = labels / total;
+    sameClass = classes / total;
+}
+
+cv::Mat tiledPipeline(ImageSource& image, ImageSource& markers,
+                      const LabelSet& validLabels,
+                      const PipelineOptions& options,
+                      const TileOptions& tileOptions) {
+    TRACE_SCOPE("tiled");
+    CV_Assert(image.size() == markers.size());
+    CV_Assert(image.type() == CV_8UC3 && markers.type() == CV_8U);
+
+    const cv::Size imageSize = image.size();
+
+    const int winSize = std::max(1, options.filterWinSize);
+    // morphology needs 2 pixels, filter window has to fit too
+    const int halo = roundUp(std::max(tileOptions.halo, std::max(2, winSize)), winSize);
+    const int concurrency = std::max(1, cv::getNumThreads());
+    const int tileSize = pickTileSize(tileOptions, halo, winSize, concurrency);
+    // tiles without seeds grow their halo up to the share of memory budget of one tile
+    const double maxTilePixels = std::max(
+        tileOptions.memoryBudgetMB * 1024. * 1024. / TILE_BYTES_PER_PIXEL / concurrency,
+        std::pow(tileSize + 2. * halo, 2));
+
+    const int tilesX = (imageSize.width + tileSize - 1) / tileSize;
+    const int tilesY = (imageSize.height + tileSize - 1) / tileSize;
+    const cv::Rect imageRect(0, 0, imageSize.width, imageSize.height);
+
+    // Otsu threshold has to be computed over the whole image,
+    // otherwise every tile would have its own one
+    size_t hueHist[HUE_HIST_SIZE] = {0};
+    std::mutex hueHistMutex;
+    std::atomic<bool> hasMarkers(false);
+    cv::parallel_for_(cv::Range(0, tilesX * tilesY), [&](const cv::Range& range) {
+        size_t localHist[HUE_HIST_SIZE] = {0};
+        for (int t = range.start; t < range.end; ++t) {
+            cv::Rect core((t % tilesX) * tileSize, (t / tilesX) * tileSize, tileSize, tileSize);
+            accumulateHueHistogram(image.read(core & imageRect), localHist);
+            if (!hasMarkers && cv::countNonZero(markers.read(core & imageRect)) > 0) {
+                hasMarkers = true;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(hueHistMutex);
+        for (int i = 0; i < HUE_HIST_SIZE; ++i) {
+            hueHist[i] += localHist[i];
+        }
+    });
+    const double hueThreshold = hueOtsuThreshold(hueHist);
+
+    // the same as the whole image run, there is nothing to grow regions from
+    if (!hasMarkers) {
+        return cv::Mat();
+    }
+
+    cv::Mat mask(imageSize, CV_8U);
+    std::atomic<int> grownTiles(0), tilesWithoutMarkers(0);
+
+    cv::parallel_for_(cv::Range(0, tilesX * tilesY), [&](const cv::Range& range) {
+        for (int t = range.start; t < range.end; ++t) {
+            const cv::Rect core = cv::Rect((t % tilesX) * tileSize, (t / tilesX) * tileSize, tileSize, tileSize) & imageRect;
+            cv::Rect tile = inflate(core, halo) & imageRect;
+            TRACE_SCOPE("tiled/tile");
+
+            cv::Mat tileImg, tileMarkers;
+            {
+                TRACE_SCOPE("tiled/read");
+                tileMarkers = markers.read(tile);
+                // The whole image run floods this area from seeds further away, so does the tile:
+                // the halo is doubled until it reaches some, as long as the tile fits into its budget.
+                // Doubling keeps the halo a multiple of winSize.
+                for (int grown = halo; cv::countNonZero(tileMarkers) == 0 && tile != imageRect; ) {
+                    const cv::Rect larger = inflate(core, grown * 2) & imageRect;
+                    if (larger.area() > maxTilePixels) {
+                        break;
+                    }
+                    grown *= 2;
+                    tile = larger;
+                    tileMarkers = markers.read(tile);
+                    if (grown == halo * 2) {
+                        grownTiles++;
+                    }
+                }
+                if (cv::countNonZero(tileMarkers) == 0) {
+                    // seeds are too far, the same as pixels no marker reached
+                    mask(core).setTo(cv::Scalar::all(unknownLabel));
+                    tilesWithoutMarkers++;
+                    continue;
+                }
+                tileImg = image.read(tile);
+            }
+            const cv::Rect coreInTile = core - tile.tl();
+
+            cv::Mat tileMask = runWatershed(tileImg, tileMarkers, options.watershed);
+            CV_Assert(!tileMask.empty());
+
+            cv::Mat thresholdMask = runThresholdBasedMethod(tileImg, hueThreshold);
+            mergeMasks(tileMask, thresholdMask);
+            thresholdMask.release();
+
+            if (options.filterMode == SLIDING_FILTER) {
+                slidingModeFilter(tileMask, validLabels, winSize / 2);
+            } else {
+                invalidColorFilter(tileMask, validLabels, winSize);
+            }
+
+            tileMask(coreInTile).copyTo(mask(core));
+        }
+    }, tilesX * tilesY);
+
+    if (grownTiles > 0) {
+        std::cout << grownTiles << " of " << tilesX * tilesY
+                  << " tiles had no markers within the halo and were processed with a larger one" << std::endl;
+    }
+    if (tilesWithoutMarkers > 0) {
+        std::cerr << tilesWithoutMarkers << " of " << tilesX * tilesY
+                  << " tiles had no markers within the tile budget and were marked as unknown" << std::endl;
+    }
+
+    return mask;
+}
+
+} // namespace
+
+cv::Mat runTiledPipeline(const cv::Mat& img0, const cv::Mat& markerMask,
+                         const LabelSet& validLabels,
+                         const PipelineOptions& options,
+                         const TileOptions& tileOptions) {
+    MatImageSource image(img0), markers(markerMask);
+    return runTiledPipeline(image, markers, validLabels, options, tileOptions);
+}
+
+cv::Mat runTiledPipeline(ImageSource& image, ImageSource& markers,
+                         const LabelSet& validLabels,
+                         const PipelineOptions& options,
+                         const TileOptions& tileOptions) {
+    if (!tileOptions.validate) {
+        return tiledPipeline(image, markers, validLabels, options, tileOptions);
+    }
+
+    double t = (double)cv::getTickCount();
+    cv::Mat mask = tiledPipeline(image, markers, validLabels, options, tileOptions);
+    double tiledMs = ((double)cv::getTickCount() - t) * 1000. / cv::getTickFrequency();
+
+    const cv::Rect imageRect(0, 0, image.size().width, image.size().height);
+    PipelineOptions wholeOptions = options;
+    wholeOptions.tiled = false;
+    t = (double)cv::getTickCount();
+    cv::Mat whole = runPipeline(image.read(imageRect), markers.read(imageRect), validLabels, wholeOptions);
+    double wholeMs = ((double)cv::getTickCount() - t) * 1000. / cv::getTickFrequency();
+
+    if (!mask.empty() && !whole.empty()) {
+        double sameLabel, sameClass;
+        maskAgreement(whole, mask, sameLabel, sameClass);
+        std::cout << "Tiled validation: whole image " << wholeMs << "ms, tiled " << tiledMs << "ms, "
+                  << sameLabel * 100 << "% of pixels have the same label, "
+                  << sameClass * 100 << "% the same class (all regions count as one)" << std::endl;
+    }
+    return mask;
+}
+
+double wholeImagePixelBudget(const TileOptions& tileOptions) {
+    return tileOptions.memoryBudgetMB * 1024. * 1024. / TILE_BYTES_PER_PIXEL;
+}
@@ -0,0 +1,26 @@
+#ifndef TILED_PIPELINE_H
+#define TILED_PIPELINE_H
+
+#include "Pipeline.h"
+#include "ImageSource.h"
+
+// Same as runPipeline, but processes img0 tile by tile in parallel,
+// so the only full-size buffer allocated is the resulting mask.
+// Labels of regions not assigned to a class are picked per tile, see TileOptions::halo.
+// Returns an empty mask if there are no markers at all.
+cv::Mat runTiledPipeline(const cv::Mat& img0, const cv::Mat& markerMask,
+                         const LabelSet& validLabels,
+                         const PipelineOptions& options = PipelineOptions(),
+                         const TileOptions& tileOptions = TileOptions());
+
+// Reads image (CV_8UC3) and markers (CV_8U) only by tiles, so neither of them
+// has to be decoded as a whole
+cv::Mat runTiledPipeline(ImageSource& image, ImageSource& markers,
+                         const LabelSet& validLabels,
+                         const PipelineOptions& options = PipelineOptions(),
+                         const TileOptions& tileOptions = TileOptions());
+
+// Largest image (pixels) runPipeline is expected to process as a whole within tileOptions.memoryBudgetMB
+double wholeImagePixelBudget(const TileOptions& tileOptions);
+
+#endif // TILED_PIPELINE_H
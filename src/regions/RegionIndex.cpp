@@ -0,0 +1,289 @@
+#include "opencv2/core/utility.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "RegionIndex.h"
+
+namespace {
+
+int findRoot(std::vector<int>& parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+void sortUnique(std::vector<int>& v) {
+    std::sort(v.begin(), v.end());
+    v.erase(std::unique(v.begin(), v.end()), v.end());
+}
+
+} // namespace
+
+void RegionIndex::build(const cv::Mat& labels) {
+    CV_Assert(labels.type() == CV_8U);
+    clear();
+
+    rows_ = labels.rows;
+    cols_ = labels.cols;
+
+    // runs of every row, rows are independent
+    std::vector<std::vector<Run> > rowRuns(rows_);
+    cv::parallel_for_(cv::Range(0, rows_), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end; ++i) {
+            const uchar* row = labels.ptr<uchar>(i);
+            for (int j = 0; j < cols_; ) {
+                Run run;
+                run.y = i;
+                run.x0 = j;
+                run.region = -1;
+                for (uchar v = row[j]; j < cols_ && row[j] == v; ++j) {}
+                run.x1 = j;
+                rowRuns[i].push_back(run);
+            }
+        }
+    });
+
+    rowStart_.resize(rows_ + 1);
+    rowStart_[0] = 0;
+    for (int i = 0; i < rows_; ++i) {
+        rowStart_[i + 1] = rowStart_[i] + (int)rowRuns[i].size();
+    }
+    runs_.reserve(rowStart_[rows_]);
+    std::vector<uchar> runLabels;
+    runLabels.reserve(rowStart_[rows_]);
+    for (int i = 0; i < rows_; ++i) {
+        const uchar* row = labels.ptr<uchar>(i);
+        for (size_t k = 0; k < rowRuns[i].size(); ++k) {
+            runs_.push_back(rowRuns[i][k]);
+            runLabels.push_back(row[rowRuns[i][k].x0]);
+        }
+        std::vector<Run>().swap(rowRuns[i]);
+    }
+
+    // runs of the same label touching each other (diagonals too) are one region,
+    // runs of different labels make their regions neighbours
+    std::vector<int> parent(runs_.size());
+    for (size_t k = 0; k < parent.size(); ++k) {
+        parent[k] = (int)k;
+    }
+    std::vector<std::pair<int, int> > edges;
+
+    for (int i = 0; i < rows_; ++i) {
+        for (int b = rowStart_[i]; b + 1 < rowStart_[i + 1]; ++b) {
+            edges.push_back(std::make_pair(b, b + 1));
+        }
+        if (i == 0) {
+            continue;
+        }
+
+        // runs of the previous row touching b, diagonally too, are [aStart, a)
+        int aStart = rowStart_[i - 1];
+        for (int b = rowStart_[i]; b < rowStart_[i + 1]; ++b) {
+            const Run& rb = runs_[b];
+            while (aStart < rowStart_[i] && runs_[aStart].x1 < rb.x0) {
+                ++aStart;
+            }
+            for (int a = aStart; a < rowStart_[i] && runs_[a].x0 <= rb.x1; ++a) {
+                if (runLabels[a] == runLabels[b]) {
+                    parent[findRoot(parent, a)] = findRoot(parent, b);
+                } else {
+                    edges.push_back(std::make_pair(a, b));
+                }
+            }
+        }
+    }
+
+    std::vector<int> regionOf(runs_.size(), -1);
+    for (size_t k = 0; k < runs_.size(); ++k) {
+        int root = findRoot(parent, (int)k);
+        if (regionOf[root] < 0) {
+            regionOf[root] = (int)regions_.size();
+            regions_.push_back(Region());
+            regions_.back().label = runLabels[k];
+            regions_.back().parent = regionOf[root];
+        }
+        int region = regionOf[root];
+        runs_[k].region = region;
+        regions_[region].runs.push_back((int)k);
+        regions_[region].area += runs_[k].x1 - runs_[k].x0;
+    }
+
+    labelPixels_.assign(256, 0);
+    labelRegions_.assign(256, 0);
+    for (size_t r = 0; r < regions_.size(); ++r) {
+        labelPixels_[regions_[r].label] += regions_[r].area;
+        ++labelRegions_[regions_[r].label];
+    }
+
+    for (size_t e = 0; e < edges.size(); ++e) {
+        int r1 = runs_[edges[e].first].region;
+        int r2 = runs_[edges[e].second].region;
+        if (r1 != r2) {
+            regions_[r1].neighbours.push_back(r2);
+            regions_[r2].neighbours.push_back(r1);
+        }
+    }
+    for (size_t r = 0; r < regions_.size(); ++r) {
+        sortUnique(regions_[r].neighbours);
+    }
+}
+
+void RegionIndex::clear() {
+    rows_ = cols_ = 0;
+    std::vector<Run>().swap(runs_);
+    std::vector<int>().swap(rowStart_);
+    std::vector<Region>().swap(regions_);
+    std::vector<size_t>().swap(labelPixels_);
+    std::vector<int>().swap(labelRegions_);
+}
+
+int RegionIndex::find(int region) {
+    while (regions_[region].parent != region) {
+        regions_[region].parent = regions_[regions_[region].parent].parent;
+        region = regions_[region].parent;
+    }
+    return region;
+}
+
+int RegionIndex::merge(int region, int other) {
+    // the one with fewer runs moves
+    if (regions_[other].runs.size() > regions_[region].runs.size()) {
+        std::swap(region, other);
+    }
+
+    Region& to = regions_[region];
+    Region& from = regions_[other];
+    from.parent = region;
+    to.area += from.area;
+    --labelRegions_[to.label];
+    to.runs.insert(to.runs.end(), from.runs.begin(), from.runs.end());
+    to.neighbours.insert(to.neighbours.end(), from.neighbours.begin(), from.neighbours.end());
+    std::vector<int>().swap(from.runs);
+    std::vector<int>().swap(from.neighbours);
+
+    return region;
+}
+
+void RegionIndex::mergeWithNeighbours(int region) {
+    // regions are maximal, so only the relabeled one can join its neighbours
+    std::vector<int> same;
+    const std::vector<int>& neighbours = regions_[region].neighbours;
+    for (size_t k = 0; k < neighbours.size(); ++k) {
+        int n = find(neighbours[k]);
+        if (n != region && regions_[n].label == regions_[region].label) {
+            same.push_back(n);
+        }
+    }
+    sortUnique(same);
+
+    for (size_t k = 0; k < same.size(); ++k) {
+        region = merge(region, same[k]);
+    }
+
+    std::vector<int>& merged = regions_[region].neighbours;
+    for (size_t k = 0; k < merged.size(); ++k) {
+        merged[k] = find(merged[k]);
+    }
+    sortUnique(merged);
+    merged.erase(std::remove(merged.begin(), merged.end(), region), merged.end());
+}
+
+int RegionIndex::runAt(cv::Point p) const {
+    if (p.x < 0 || p.x >= cols_ || p.y < 0 || p.y >= rows_) {
+        return -1;
+    }
+
+    // last run of the row starting at or before p.x
+    int lo = rowStart_[p.y], hi = rowStart_[p.y + 1];
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (runs_[mid].x0 <= p.x) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+cv::Rect RegionIndex::regionRect(cv::Point p) {
+    int run = runAt(p);
+    if (run < 0) {
+        return cv::Rect();
+    }
+
+    const std::vector<int>& runs = regions_[find(runs_[run].region)].runs;
+    int x0 = cols_, y0 = rows_, x1 = 0, y1 = 0;
+    for (size_t k = 0; k < runs.size(); ++k) {
+        const Run& r = runs_[runs[k]];
+        x0 = std::min(x0, r.x0);
+        x1 = std::max(x1, r.x1);
+        y0 = std::min(y0, r.y);
+        y1 = std::max(y1, r.y + 1);
+    }
+    return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+size_t RegionIndex::fill(cv::Mat& labels, cv::Point seed, uchar label) {
+    CV_Assert(labels.type() == CV_8U && labels.rows == rows_ && labels.cols == cols_);
+
+    int run = runAt(seed);
+    if (run < 0) {
+        return 0;
+    }
+
+    int region = find(runs_[run].region);
+    if (regions_[region].label == label) {
+        return 0;
+    }
+
+    const std::vector<int>& runs = regions_[region].runs;
+    for (size_t k = 0; k < runs.size(); ++k) {
+        const Run& r = runs_[runs[k]];
+        memset(labels.ptr<uchar>(r.y) + r.x0, label, r.x1 - r.x0);
+    }
+
+    size_t area = regions_[region].area;
+    countRelabel(region, label);
+    mergeWithNeighbours(region);
+
+    return area;
+}
+
+void RegionIndex::relabel(uchar from, uchar to) {
+    if (from == to) {
+        return;
+    }
+
+    std::vector<int> changed;
+    for (size_t r = 0; r < regions_.size(); ++r) {
+        if (regions_[r].parent == (int)r && regions_[r].label == from) {
+            countRelabel((int)r, to);
+            changed.push_back((int)r);
+        }
+    }
+
+    for (size_t k = 0; k < changed.size(); ++k) {
+        mergeWithNeighbours(find(changed[k]));
+    }
+}
+
+void RegionIndex::countRelabel(int region, uchar label) {
+    Region& r = regions_[region];
+    labelPixels_[r.label] -= r.area;
+    --labelRegions_[r.label];
+    r.label = label;
+    labelPixels_[label] += r.area;
+    ++labelRegions_[label];
+}
+
+int RegionIndex::regionsCount() const {
+    int count = 0;
+    for (size_t r = 0; r < regions_.size(); ++r) {
+        count += regions_[r].parent == (int)r;
+    }
+    return count;
+}
@@ -0,0 +1,73 @@
+#ifndef REGION_INDEX_H
+#define REGION_INDEX_H
+
+#include "opencv2/core.hpp"
+
+#include <vector>
+
+// 8-connected regions of equal labels of a CV_8U mask stored as horizontal runs.
+// Built once per mask, after that relabeling a region costs O(its runs)
+// instead of a flood fill, and the index follows its own changes.
+// Pixels and regions of every label are counted along the way.
+class RegionIndex {
+public:
+    RegionIndex() : rows_(0), cols_(0) {}
+
+    void build(const cv::Mat& labels);
+    void clear();
+    bool empty() const { return runs_.empty(); }
+
+    // Gives the whole region containing seed the label, in labels and in the index,
+    // the same as 8-connected cv::floodFill with zero difference. Returns number of changed pixels.
+    size_t fill(cv::Mat& labels, cv::Point seed, uchar label);
+
+    // Bounding rect of the region containing p (what fill would change), empty if p is outside
+    cv::Rect regionRect(cv::Point p);
+
+    // Follows relabelImg(labels, {from}, {to}), which has to be applied to the pixels separately
+    void relabel(uchar from, uchar to);
+
+    int regionsCount() const;
+
+    // indexed by label, as of the last build and the changes since then
+    const std::vector<size_t>& labelPixels() const { return labelPixels_; }
+    const std::vector<int>& labelRegions() const { return labelRegions_; }
+
+private:
+    struct Run {
+        int y;
+        int x0, x1; // [x0, x1)
+        int region;
+    };
+
+    struct Region {
+        Region() : label(0), area(0), parent(-1) {}
+
+        uchar label;
+        size_t area;
+        // regions merged into another one point to it
+        int parent;
+        std::vector<int> runs;
+        // may contain merged regions and duplicates, resolved with find()
+        std::vector<int> neighbours;
+    };
+
+    int find(int region);
+    // merges two regions with the same label, returns the one which is left
+    int merge(int region, int other);
+    // merges region with its neighbours of the same label
+    void mergeWithNeighbours(int region);
+    int runAt(cv::Point p) const;
+    // moves region from its label to another in the counters
+    void countRelabel(int region, uchar label);
+
+    int rows_, cols_;
+    std::vector<Run> runs_;
+    // runs of row y are [rowStart_[y], rowStart_[y + 1])
+    std::vector<int> rowStart_;
+    std::vector<Region> regions_;
+    std::vector<size_t> labelPixels_;
+    std::vector<int> labelRegions_;
+};
+
+#endif // REGION_INDEX_H
@@ -0,0 +1,60 @@
+#include "Segmenter.h"
+#include "TiledPipeline.h"
+
+namespace {
+
+// result goes into labels memory if it has the right size, so wrapped buffers get filled
+void storeLabels(const cv::Mat& result, cv::Mat& labels) {
+    if (!labels.empty() && labels.size() == result.size() && labels.type() == result.type()) {
+        result.copyTo(labels);
+    } else {
+        labels = result;
+    }
+}
+
+} // namespace
+
+Segmenter::Segmenter(const PipelineOptions& options) : options_(options) {
+    initLabelSet(validLabels_);
+}
+
+bool Segmenter::segment(const cv::Mat& img, const cv::Mat& markers, cv::Mat& labels) {
+    CV_Assert(img.type() == CV_8UC3 && markers.type() == CV_8U && img.size() == markers.size());
+
+    cv::Mat result;
+    if (options_.tiled) {
+        result = runTiledPipeline(img, markers, validLabels_, options_, options_.tiles);
+    } else {
+        result = runPipeline(img, markers, validLabels_, options_);
+    }
+    if (result.empty()) {
+        return false;
+    }
+
+    storeLabels(result, labels);
+    return true;
+}
+
+bool Segmenter::segment(ImageSource& img, ImageSource& markers, cv::Mat& labels) {
+    CV_Assert(img.type() == CV_8UC3 && markers.type() == CV_8U && img.size() == markers.size());
+
+    cv::Mat result = runTiledPipeline(img, markers, validLabels_, options_, options_.tiles);
+    if (result.empty()) {
+        return false;
+    }
+
+    storeLabels(result, labels);
+    return true;
+}
+
+bool Segmenter::watershed(const cv::Mat& img, const cv::Mat& markers, const cv::Rect& dirty) {
+    return runWatershedIncremental(img, markers, dirty, state_, options_.watershed);
+}
+
+void Segmenter::render(const cv::Mat& gray, cv::Mat& labels, cv::Mat& preview) const {
+    renderWatershed(state_, gray, labels, preview);
+}
+
+cv::Mat wrapBuffer(const void* data, int width, int height, int type, size_t step) {
+    return cv::Mat(height, width, type, const_cast<void*>(data), step ? step : cv::Mat::AUTO_STEP);
+}
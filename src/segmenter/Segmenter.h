@@ -0,0 +1,59 @@
+#ifndef SEGMENTER_H
+#define SEGMENTER_H
+
+#include "opencv2/imgproc.hpp"
+
+#include "ImageSource.h"
+#include "Palette.h"
+#include "Pipeline.h"
+#include "Watershed.h"
+
+// One segmentation context of the library: options and the watershed result kept between runs.
+// Contexts share nothing, so any number of them may run at the same time in different threads,
+// but one context has to be used by one thread at a time.
+class Segmenter {
+public:
+    explicit Segmenter(const PipelineOptions& options = PipelineOptions());
+
+    PipelineOptions& options() { return options_; }
+    const PipelineOptions& options() const { return options_; }
+
+    // labels the mask filter keeps, every class except "not specified" by default
+    LabelSet& validLabels() { return validLabels_; }
+
+    // The whole chain of runPipeline (or runTiledPipeline if options().tiled).
+    // img is CV_8UC3 BGR, markers is CV_8U with nonzero seeds, both may wrap caller's memory (see wrapBuffer).
+    // labels (CV_8U) which already has the right size and type is written in place,
+    // so it may wrap caller's memory as well. Returns false if there are no markers.
+    bool segment(const cv::Mat& img, const cv::Mat& markers, cv::Mat& labels);
+
+    // Same for images read by rectangles (runTiledPipeline)
+    bool segment(ImageSource& img, ImageSource& markers, cv::Mat& labels);
+
+    // Watershed only, the result is kept in state(). Markers are expected to have changed
+    // only inside dirty since the last call (empty dirty means nothing changed),
+    // then only the regions around it are flooded again, see runWatershedIncremental.
+    // The first call (and the first one after reset) floods the whole image.
+    bool watershed(const cv::Mat& img, const cv::Mat& markers, const cv::Rect& dirty = cv::Rect());
+
+    // Labels of the last watershed run (CV_8U) and their preview blended with gray (CV_8UC3),
+    // see renderWatershed
+    void render(const cv::Mat& gray, cv::Mat& labels, cv::Mat& preview) const;
+
+    const WatershedState& state() const { return state_; }
+
+    // forgets the last watershed result
+    void reset() { state_.clear(); }
+
+private:
+    PipelineOptions options_;
+    LabelSet validLabels_;
+    WatershedState state_;
+};
+
+// Mat header over caller's buffer of type (CV_8UC3 images, CV_8U markers and labels),
+// nothing is copied and the buffer has to outlive the header.
+// step is the size of a row in bytes, 0 means rows are packed.
+cv::Mat wrapBuffer(const void* data, int width, int height, int type, size_t step = 0);
+
+#endif // SEGMENTER_H
@@ -0,0 +1,589 @@
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/core/utility.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Service.h"
+#include "LabelFile.h"
+#include "Palette.h"
+#include "Segmenter.h"
+#include "Trace.h"
+
+namespace {
+
+// latencies of the last requests STATS percentiles are computed from
+const size_t LATENCY_SAMPLES = 10000;
+const int POLL_TIMEOUT_MS = 200;
+const size_t MAX_LINE = 4096;
+// responses a client doesn't read, more and it's disconnected
+const size_t MAX_OUTPUT = 1 << 20;
+
+volatile sig_atomic_t stopRequested = 0;
+
+void onStopSignal(int) {
+    stopRequested = 1;
+}
+
+double elapsedMs(int64 since) {
+    return ((double)cv::getTickCount() - since) * 1000. / cv::getTickFrequency();
+}
+
+// Client connection (non-blocking socket), responses may come from any worker.
+// Nobody waits for a slow client: what the socket doesn't take right away is kept
+// and sent by the I/O thread once the socket is writable.
+class Connection {
+public:
+    explicit Connection(int fd) : fd_(fd), broken_(false) {}
+    ~Connection() { close(fd_); }
+
+    int fd() const { return fd_; }
+
+    void reply(const std::string& line) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (broken_) {
+            return;
+        }
+        output_ += line;
+        output_ += '\n';
+        sendOutput();
+        if (output_.size() > MAX_OUTPUT) {
+            // client doesn't read responses
+            broken_ = true;
+            output_.clear();
+        }
+    }
+
+    // sends what's left of the responses, called by the I/O thread when the socket is writable
+    void flush() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sendOutput();
+    }
+
+    bool hasOutput() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return !output_.empty();
+    }
+
+    // client has gone or doesn't read, the connection should be closed
+    bool broken() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return broken_;
+    }
+
+    // incomplete line read so far, used only by the I/O thread
+    std::string input;
+
+private:
+    void sendOutput() {
+        size_t sent = 0;
+        while (sent < output_.size() && !broken_) {
+            ssize_t n = send(fd_, output_.data() + sent, output_.size() - sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                sent += n;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                // client has gone, nobody to tell
+                broken_ = true;
+            }
+        }
+        if (broken_) {
+            output_.clear();
+        } else {
+            output_.erase(0, sent);
+        }
+    }
+
+    int fd_;
+    bool broken_;
+    std::string output_;
+    mutable std::mutex mutex_;
+};
+
+struct Request {
+    Request() : shared(false), width(0), height(0), bytes(0), received(0) {}
+
+    bool shared;
+    // SEGMENT
+    std::string image, markers, mask;
+    // SEGMENT_SHM
+    std::string shmName;
+    int width, height;
+
+    // input size, decides about batching
+    size_t bytes;
+    int64 received;
+    std::shared_ptr<Connection> connection;
+};
+
+class ServiceStats {
+public:
+    ServiceStats() : done_(0), failed_(0), rejected_(0), batches_(0), next_(0) {}
+
+    void record(double ms, bool ok) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        (ok ? done_ : failed_)++;
+        if (latencies_.size() < LATENCY_SAMPLES) {
+            latencies_.push_back(ms);
+        } else {
+            latencies_[next_] = ms;
+            next_ = (next_ + 1) % LATENCY_SAMPLES;
+        }
+    }
+
+    void rejected() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rejected_++;
+    }
+
+    void batch() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        batches_++;
+    }
+
+    std::string report(size_t queued) const {
+        std::vector<double> sorted;
+        std::ostringstream out;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sorted = latencies_;
+            out << "OK done=" << done_ << " failed=" << failed_ << " rejected=" << rejected_
+                << " batches=" << batches_ << " queued=" << queued;
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        const double percentiles[] = {50, 90, 99};
+        for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+            out << " p" << percentiles[i] << "_ms=" << percentile(sorted, percentiles[i]);
+        }
+        out << " max_ms=" << (sorted.empty() ? 0. : sorted.back());
+        return out.str();
+    }
+
+private:
+    // nearest rank
+    static double percentile(const std::vector<double>& sorted, double p) {
+        if (sorted.empty()) {
+            return 0;
+        }
+        size_t rank = (size_t)std::ceil(p / 100. * sorted.size());
+        return sorted[std::min(std::max(rank, (size_t)1), sorted.size()) - 1];
+    }
+
+    mutable std::mutex mutex_;
+    size_t done_, failed_, rejected_, batches_;
+    std::vector<double> latencies_;
+    size_t next_;
+};
+
+class RequestQueue {
+public:
+    RequestQueue(size_t maxSize) : maxSize_(maxSize), closed_(false), idle_(0) {}
+
+    // false if the queue is full
+    bool push(const Request& request) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (requests_.size() >= maxSize_) {
+                return false;
+            }
+            requests_.push_back(request);
+        }
+        ready_.notify_one();
+        return true;
+    }
+
+    // Waits for a request. A small one comes with up to maxBatch - 1 more small requests queued after it,
+    // but only with those idle workers can't take, they'd process them sooner on their own.
+    // Returns false when the queue is closed and empty.
+    bool pop(std::vector<Request>& batch, int maxBatch, size_t smallBytes) {
+        batch.clear();
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_++;
+        ready_.wait(lock, [this]() { return closed_ || !requests_.empty(); });
+        idle_--;
+        if (requests_.empty()) {
+            return false;
+        }
+
+        batch.push_back(requests_.front());
+        requests_.pop_front();
+        if (batch[0].bytes >= smallBytes) {
+            return true;
+        }
+        for (std::deque<Request>::iterator it = requests_.begin();
+             it != requests_.end() && (int)batch.size() < maxBatch && requests_.size() > idle_; ) {
+            if (it->bytes < smallBytes) {
+                batch.push_back(*it);
+                it = requests_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return true;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return requests_.size();
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        ready_.notify_all();
+    }
+
+private:
+    size_t maxSize_;
+    bool closed_;
+    // workers waiting for requests
+    size_t idle_;
+    std::deque<Request> requests_;
+    mutable std::mutex mutex_;
+    std::condition_variable ready_;
+};
+
+size_t fileBytes(const std::string& filename) {
+    struct stat st;
+    return stat(filename.c_str(), &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+// Parses SEGMENT / SEGMENT_SHM, returns empty string or the reason it's wrong
+std::string parseRequest(const std::string& command, std::istringstream& args, Request& request) {
+    if (command == "SEGMENT") {
+        if (!(args >> request.image >> request.markers >> request.mask)) {
+            return "usage: SEGMENT <image> <markers> <mask>";
+        }
+        request.bytes = fileBytes(request.image);
+        return "";
+    }
+
+    request.shared = true;
+    if (!(args >> request.shmName >> request.width >> request.height) ||
+            request.width <= 0 || request.height <= 0) {
+        return "usage: SEGMENT_SHM <name> <width> <height>";
+    }
+    request.bytes = (size_t)request.width * request.height * 5;
+    return "";
+}
+
+bool writeMask(const std::string& filename, const cv::Mat& labels) {
+    const std::string ext(".lbl");
+    if (filename.size() > ext.size() && filename.substr(filename.size() - ext.size()) == ext) {
+        return writeLabelFile(filename, labels, true);
+    }
+    cv::Mat colors;
+    colorizeLabels(labels, colors);
+    return cv::imwrite(filename, colors);
+}
+
+// Returns empty string or what went wrong
+std::string segmentFiles(const Request& request, Segmenter& segmenter) {
+    cv::Mat img, markers;
+    {
+        TRACE_SCOPE("load/image");
+        img = cv::imread(request.image, cv::IMREAD_COLOR);
+        markers = isLabelFile(request.markers) ? readLabelFile(request.markers)
+                                               : cv::imread(request.markers, cv::IMREAD_GRAYSCALE);
+    }
+    if (img.empty() || markers.empty()) {
+        return "can't read image or markers";
+    }
+    if (img.size() != markers.size()) {
+        return "markers don't match image size";
+    }
+
+    cv::Mat labels;
+    if (!segmenter.segment(img, markers, labels)) {
+        return "markers are empty";
+    }
+
+    TRACE_SCOPE("save/mask");
+    if (!writeMask(request.mask, labels)) {
+        return "can't write " + request.mask;
+    }
+    return "";
+}
+
+std::string segmentSharedMemory(const Request& request, Segmenter& segmenter) {
+    const size_t pixels = (size_t)request.width * request.height;
+    const size_t bytes = pixels * 5;
+
+    int fd = shm_open(request.shmName.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        return "can't open shared memory " + request.shmName;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < bytes) {
+        close(fd);
+        return "shared memory is smaller than width * height * 5 bytes";
+    }
+    void* mapped = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return "can't map shared memory " + request.shmName;
+    }
+
+    uchar* data = (uchar*)mapped;
+    cv::Mat img = wrapBuffer(data, request.width, request.height, CV_8UC3);
+    cv::Mat markers = wrapBuffer(data + pixels * 3, request.width, request.height, CV_8U);
+    cv::Mat labels = wrapBuffer(data + pixels * 4, request.width, request.height, CV_8U);
+
+    bool ok;
+    try {
+        ok = segmenter.segment(img, markers, labels);
+    } catch (...) {
+        munmap(mapped, bytes);
+        throw;
+    }
+    munmap(mapped, bytes);
+    return ok ? "" : "markers are empty";
+}
+
+void process(const Request& request, const PipelineOptions& options, ServiceStats& stats) {
+    TRACE_SCOPE("service/request");
+    Segmenter segmenter(options);
+    std::string error;
+    try {
+        error = request.shared ? segmentSharedMemory(request, segmenter) : segmentFiles(request, segmenter);
+    } catch (const cv::Exception& e) {
+        error = e.what();
+        std::replace(error.begin(), error.end(), '\n', ' ');
+    } catch (const std::bad_alloc&) {
+        error = "out of memory";
+    } catch (const std::exception& e) {
+        error = e.what();
+        std::replace(error.begin(), error.end(), '\n', ' ');
+    } catch (...) {
+        // whatever a request throws, the service and the other requests go on
+        error = "unknown error";
+    }
+
+    const double ms = elapsedMs(request.received);
+    stats.record(ms, error.empty());
+    if (error.empty()) {
+        std::ostringstream reply;
+        reply << "OK " << ms;
+        request.connection->reply(reply.str());
+    } else {
+        request.connection->reply("ERR " + error);
+    }
+}
+
+int listenSocket(const std::string& path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Bad socket path " << path << std::endl;
+        return -1;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        std::cerr << "Can't create socket: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    unlink(path.c_str());
+    // Requests make the service read and write files with its permissions,
+    // so only its own user can connect. The socket is created without group and other permissions
+    // (no other threads run yet to be affected by umask) and the mode is set explicitly too.
+    const mode_t prevMask = umask(0077);
+    const bool bound = bind(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(prevMask);
+    if (!bound || chmod(path.c_str(), 0600) != 0 || listen(fd, SOMAXCONN) != 0) {
+        std::cerr << "Can't listen on " << path << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+} // namespace
+
+int runService(const ServiceOptions& options) {
+    const int listenFd = listenSocket(options.socketPath);
+    if (listenFd < 0) {
+        return 1;
+    }
+
+    const int workersCount = std::max(1, options.workers > 0 ? options.workers : cv::getNumberOfCPUs());
+    // cores are shared between workers, large requests use their share inside the pipeline,
+    // batches of small requests use it to process them side by side.
+    // Requests share no work, so a batch larger than the share would only queue them inside the worker
+    // (with the default worker per core there are no batches, idle workers take small requests).
+    const int threadsPerWorker = std::max(1, cv::getNumberOfCPUs() / workersCount);
+    const int maxBatch = std::max(1, std::min(options.maxBatch, threadsPerWorker));
+    int prevCvThreads = cv::getNumThreads();
+    cv::setNumThreads(threadsPerWorker);
+
+    stopRequested = 0;
+    signal(SIGINT, onStopSignal);
+    signal(SIGTERM, onStopSignal);
+
+    RequestQueue queue(options.maxQueue);
+    ServiceStats stats;
+
+    std::vector<std::thread> workers;
+    for (int w = 0; w < workersCount; ++w) {
+        workers.push_back(std::thread([&]() {
+            std::vector<Request> batch;
+            while (queue.pop(batch, maxBatch, options.smallBytes)) {
+                if (batch.size() == 1) {
+                    process(batch[0], options.pipeline, stats);
+                    continue;
+                }
+                stats.batch();
+                cv::parallel_for_(cv::Range(0, (int)batch.size()), [&](const cv::Range& range) {
+                    for (int i = range.start; i < range.end; ++i) {
+                        process(batch[i], options.pipeline, stats);
+                    }
+                });
+            }
+        }));
+    }
+
+    std::cout << "Listening on " << options.socketPath << " with " << workersCount << " workers" << std::endl;
+
+    std::map<int, std::shared_ptr<Connection> > connections;
+    std::vector<char> buffer(MAX_LINE);
+    while (!stopRequested) {
+        std::vector<pollfd> fds(1);
+        fds[0].fd = listenFd;
+        fds[0].events = POLLIN;
+        for (std::map<int, std::shared_ptr<Connection> >::const_iterator it = connections.begin();
+             it != connections.end(); ++it) {
+            pollfd p = {it->first, (short)(POLLIN | (it->second->hasOutput() ? POLLOUT : 0)), 0};
+            fds.push_back(p);
+        }
+
+        if (poll(&fds[0], fds.size(), POLL_TIMEOUT_MS) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "poll failed: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listenFd, 0, 0);
+            if (fd >= 0) {
+                if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == 0) {
+                    connections[fd] = std::make_shared<Connection>(fd);
+                } else {
+                    close(fd);
+                }
+            }
+        }
+
+        for (size_t i = 1; i < fds.size() && !stopRequested; ++i) {
+            std::shared_ptr<Connection> connection = connections[fds[i].fd];
+            if (fds[i].revents & POLLOUT) {
+                connection->flush();
+            }
+            if (connection->broken()) {
+                connections.erase(fds[i].fd);
+                continue;
+            }
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            ssize_t n = recv(fds[i].fd, &buffer[0], buffer.size(), 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                continue;
+            }
+            if (n <= 0) {
+                // queued requests keep the connection until they are answered
+                connections.erase(fds[i].fd);
+                continue;
+            }
+            connection->input.append(&buffer[0], n);
+
+            size_t end;
+            while ((end = connection->input.find('\n')) != std::string::npos) {
+                std::string line = connection->input.substr(0, end);
+                connection->input.erase(0, end + 1);
+                if (!line.empty() && line[line.size() - 1] == '\r') {
+                    line.erase(line.size() - 1);
+                }
+
+                std::istringstream args(line);
+                std::string command;
+                args >> command;
+                if (command.empty()) {
+                    continue;
+                }
+
+                if (command == "STATS") {
+                    connection->reply(stats.report(queue.size()));
+                } else if (command == "SHUTDOWN") {
+                    connection->reply("OK");
+                    stopRequested = 1;
+                } else if (command == "SEGMENT" || command == "SEGMENT_SHM") {
+                    Request request;
+                    const std::string error = parseRequest(command, args, request);
+                    if (!error.empty()) {
+                        connection->reply("ERR " + error);
+                        continue;
+                    }
+                    request.received = cv::getTickCount();
+                    request.connection = connection;
+                    if (!queue.push(request)) {
+                        stats.rejected();
+                        connection->reply("ERR busy");
+                    }
+                } else {
+                    connection->reply("ERR unknown command " + command);
+                }
+            }
+            if (connection->input.size() > MAX_LINE) {
+                connection->reply("ERR line too long");
+                connections.erase(fds[i].fd);
+            }
+        }
+    }
+
+    std::cout << "Shutting down, finishing " << queue.size() << " queued requests" << std::endl;
+    close(listenFd);
+    unlink(options.socketPath.c_str());
+
+    queue.close();
+    for (size_t w = 0; w < workers.size(); ++w) {
+        workers[w].join();
+    }
+    connections.clear();
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    cv::setNumThreads(prevCvThreads);
+
+    std::cout << stats.report(0) << std::endl;
+    return 0;
+}
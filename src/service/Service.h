@@ -0,0 +1,43 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include <string>
+
+#include "Pipeline.h"
+
+struct ServiceOptions {
+    ServiceOptions() : workers(0), maxQueue(64), maxBatch(8), smallBytes(4 << 20) {}
+
+    // Unix domain socket the service listens on, recreated on start
+    std::string socketPath;
+    // number of requests processed at the same time, 0 means one worker per core
+    int workers;
+    // requests waiting for a worker, more are rejected right away
+    size_t maxQueue;
+    // small requests a worker takes from the queue at once and processes in parallel,
+    // at most as many as the worker has cores (see workers)
+    int maxBatch;
+    // requests with less input (image file or shared memory bytes) are small
+    size_t smallBytes;
+    PipelineOptions pipeline;
+};
+
+// Daemon mode: segments images on requests coming through options.socketPath,
+// so clients don't pay for process startup and OpenCV initialization per image.
+// Text protocol, one request per line, one response line per request ("OK ..." or "ERR <reason>"):
+//   SEGMENT <image> <markers> <mask>
+//       reads image and markers (PNG, TIFF or label file), writes the label mask to <mask>
+//       (label file if it ends with .lbl, colored PNG otherwise), responds "OK <ms>"
+//   SEGMENT_SHM <name> <width> <height>
+//       POSIX shared memory object <name> holds BGR image (width * height * 3 bytes),
+//       markers and then labels (width * height bytes each), labels are written in place,
+//       responds "OK <ms>"
+//   STATS
+//       counters and latency percentiles (from request arrival to response) of the recent requests
+//   SHUTDOWN
+//       finishes queued requests and exits, the same as SIGINT / SIGTERM
+// Only the user running the service can connect to the socket.
+// Paths and names can't contain spaces. Returns process exit code.
+int runService(const ServiceOptions& options);
+
+#endif // SERVICE_H
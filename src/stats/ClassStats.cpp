@@ -0,0 +1,111 @@
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "ClassStats.h"
+#include "Palette.h"
+
+namespace {
+
+double fraction(const ClassStats& stats, const ClassStats::Row& row) {
+    return stats.pixels ? (double)row.pixels / stats.pixels : 0.;
+}
+
+} // namespace
+
+ClassStats classStats(const RegionIndex& regions) {
+    return classStats(regions.labelPixels(), regions.labelRegions());
+}
+
+ClassStats classStats(const std::vector<size_t>& pixels, const std::vector<int>& counts) {
+    ClassStats stats;
+    if (pixels.size() < LABEL_COUNT || counts.size() < LABEL_COUNT) {
+        return stats;
+    }
+
+    for (int label = 0; label <= firstRegionLabel; ++label) {
+        if (label > boundaryLabel && label < firstRegionLabel) {
+            continue;
+        }
+        ClassStats::Row row;
+        row.label = label;
+        row.name = labelName((uchar)label);
+        stats.rows.push_back(row);
+    }
+
+    for (int label = 0; label < LABEL_COUNT; ++label) {
+        if (label > boundaryLabel && label < firstRegionLabel) {
+            // unused labels, shouldn't be in masks
+            if (pixels[label]) {
+                std::cerr << "Mask has " << pixels[label] << " pixels of unused label " << label << std::endl;
+            }
+            continue;
+        }
+        ClassStats::Row& row = label < firstRegionLabel ? stats.rows[label] : stats.rows.back();
+        row.pixels += pixels[label];
+        row.regions += counts[label];
+        stats.pixels += pixels[label];
+    }
+    return stats;
+}
+
+std::string classStatsTable(const ClassStats& stats) {
+    std::ostringstream table;
+    table << std::fixed << std::setprecision(2) << "Classes of " << stats.pixels << " pixels:";
+    for (size_t k = 0; k < stats.rows.size(); ++k) {
+        const ClassStats::Row& row = stats.rows[k];
+        if (row.pixels == 0) {
+            continue;
+        }
+        table << "\n\t" << std::left << std::setw(16) << row.name << std::right
+              << std::setw(12) << row.pixels << std::setw(8) << 100 * fraction(stats, row) << "%"
+              << std::setw(8) << row.regions << " regions";
+    }
+    return table.str();
+}
+
+bool writeClassStatsCsv(const std::string& filename, const ClassStats& stats) {
+    std::ofstream out(filename.c_str());
+    if (!out) {
+        std::cerr << "Can't write " << filename << std::endl;
+        return false;
+    }
+
+    out << std::setprecision(6) << "label,name,pixels,fraction,regions\n";
+    for (size_t k = 0; k < stats.rows.size(); ++k) {
+        const ClassStats::Row& row = stats.rows[k];
+        out << row.label << "," << row.name << "," << row.pixels << ","
+            << fraction(stats, row) << "," << row.regions << "\n";
+    }
+    return (bool)out;
+}
+
+bool writeClassStatsJson(const std::string& filename, const ClassStats& stats) {
+    std::ofstream out(filename.c_str());
+    if (!out) {
+        std::cerr << "Can't write " << filename << std::endl;
+        return false;
+    }
+
+    // names are plain words, nothing to escape
+    out << std::setprecision(6) << "{\"pixels\":" << stats.pixels << ",\"classes\":[";
+    for (size_t k = 0; k < stats.rows.size(); ++k) {
+        const ClassStats::Row& row = stats.rows[k];
+        out << (k ? ",\n" : "\n")
+            << "{\"label\":" << row.label << ",\"name\":\"" << row.name << "\""
+            << ",\"pixels\":" << row.pixels << ",\"fraction\":" << fraction(stats, row)
+            << ",\"regions\":" << row.regions << "}";
+    }
+    out << "\n]}\n";
+    return (bool)out;
+}
+
+std::string classStatsFileName(const std::string& maskFilename, const std::string& extension) {
+    const std::string ext(".png");
+    std::string base = maskFilename;
+    if (base.size() > ext.size() && base.substr(base.size() - ext.size()) == ext) {
+        base = base.substr(0, base.size() - ext.size());
+    }
+    return base + "_stats." + extension;
+}
@@ -0,0 +1,44 @@
+#ifndef CLASS_STATS_H
+#define CLASS_STATS_H
+
+#include <string>
+#include <vector>
+
+#include "RegionIndex.h"
+
+// Per-class area of a mask for dataset QA, taken from the counters RegionIndex keeps up to date,
+// so there is no pass over the mask. Every class and special label has its own row,
+// unassigned watershed regions (firstRegionLabel and above) share the last one.
+struct ClassStats {
+    struct Row {
+        Row() : label(0), pixels(0), regions(0) {}
+
+        int label;
+        std::string name;
+        size_t pixels;
+        int regions;
+    };
+
+    ClassStats() : pixels(0) {}
+
+    std::vector<Row> rows;
+    size_t pixels;
+};
+
+ClassStats classStats(const RegionIndex& regions);
+
+// The same from counters of RegionIndex::labelPixels() and labelRegions() kept aside
+ClassStats classStats(const std::vector<size_t>& labelPixels, const std::vector<int>& labelRegions);
+
+// Human readable table of non-empty rows
+std::string classStatsTable(const ClassStats& stats);
+
+// All rows: label, name, pixels, fraction of the mask, regions.
+// The region row has label firstRegionLabel.
+bool writeClassStatsCsv(const std::string& filename, const ClassStats& stats);
+bool writeClassStatsJson(const std::string& filename, const ClassStats& stats);
+
+// x_mask.png -> x_mask_stats.<extension>
+std::string classStatsFileName(const std::string& maskFilename, const std::string& extension);
+
+#endif // CLASS_STATS_H
@@ -1,29 +1,213 @@
-//#include <opencv2/core/utility.hpp>
+#include <opencv2/core/utility.hpp>
 
-#include "ImageUtils.h"
+#include <cfloat>
+#include <cmath>
 
-cv::Mat runThresholdBasedMethod(const cv::Mat& src) {
-    std::vector<cv::Mat> channels;
-    cv::Mat image_hsv;
+#include "Palette.h"
+#include "Trace.h"
+#include "HueThreshold.h"
+
+namespace {
+
+// Hue of BGR pixels computed the same way as the integer path of cv::cvtColor(..., CV_BGR2HSV)
+// (RGB2HSV_b in imgproc), so the fused kernels below give bit to bit the same hue
+class HueTable {
+public:
+    HueTable() {
+        hdiv_[0] = 0;
+        for (int i = 1; i < 256; ++i) {
+            hdiv_[i] = cv::saturate_cast<int>((180 << HSV_SHIFT) / (6. * i));
+        }
+    }
+
+    void hueRow(const uchar* bgr, uchar* hue, int cols) const {
+        for (int x = 0; x < cols; ++x, bgr += 3) {
+            int b = bgr[0], g = bgr[1], r = bgr[2];
+            int v = std::max(std::max(b, g), r);
+            int vmin = std::min(std::min(b, g), r);
+            int diff = v - vmin;
+            int vr = v == r ? -1 : 0;
+            int vg = v == g ? -1 : 0;
+
+            int h = (vr & (g - b)) + (~vr & ((vg & (b - r + 2 * diff)) + ((~vg) & (r - g + 4 * diff))));
+            h = (h * hdiv_[diff] + (1 << (HSV_SHIFT - 1))) >> HSV_SHIFT;
+            h += h < 0 ? 180 : 0;
+            hue[x] = cv::saturate_cast<uchar>(h);
+        }
+    }
+
+private:
+    static const int HSV_SHIFT = 12;
+    int hdiv_[256];
+};
+
+const HueTable& hueTable() {
+    static const HueTable table;
+    return table;
+}
+
+// Rows [begin, end) of `rows` split into about one stripe per thread
+int stripesCount(int rows) {
+    return std::max(1, std::min(rows, cv::getNumThreads()));
+}
+
+cv::Range stripeRows(int stripe, int stripes, int rows) {
+    return cv::Range((int)((int64_t)rows * stripe / stripes), (int)((int64_t)rows * (stripe + 1) / stripes));
+}
 
-    cv::cvtColor(src, image_hsv, CV_BGR2HSV);
-    cv::split(image_hsv, channels);
+// Hue threshold, 3x3 opening and relabeling fused into one pass over src.
+// Every stripe thresholds its rows with two rows of context on each side and opens them locally,
+// borders are handled as in cv::morphologyEx (pixels outside the image are ignored).
+cv::Mat thresholdLabels(const cv::Mat& src, double hueThreshold) {
+    CV_Assert(src.type() == CV_8UC3);
 
-    cv::Mat dst;
-    //    cv::threshold(channels[0], dst, 131, 255, cv::THRESH_BINARY);
-    //    cv::adaptiveThreshold(channels[0], dst, 255, cv::ADAPTIVE_THRESH_GAUSSIAN_C, cv::THRESH_BINARY, 3, 2);
-    cv::threshold(channels[0], dst, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+    // hue > ithresh, the way cv::threshold compares CV_8U values with THRESH_BINARY
+    const int ithresh = (int)std::floor(std::min(std::max(hueThreshold, -1.), 255.));
+    const int rows = src.rows, cols = src.cols;
+    const int stripes = stripesCount(rows);
+    const HueTable& table = hueTable();
 
-    int morph_elem = cv::MORPH_RECT;
-    int morph_size = 1;
-    auto element = getStructuringElement(morph_elem, cv::Size(2*morph_size + 1, 2*morph_size + 1), cv::Point(morph_size, morph_size));
-    morphologyEx(dst, dst, cv::MORPH_OPEN, element);
+    cv::Mat dst(src.size(), CV_8UC1);
+    cv::parallel_for_(cv::Range(0, stripes), [&](const cv::Range& range) {
+        std::vector<uchar> hue(cols), mask, eroded;
+        for (int stripe = range.start; stripe < range.end; ++stripe) {
+            const cv::Range out = stripeRows(stripe, stripes, rows);
+            if (out.empty()) {
+                continue;
+            }
+            // binary rows [y0, y1), eroded rows [e0, e1)
+            const int y0 = std::max(out.start - 2, 0), y1 = std::min(out.end + 2, rows);
+            const int e0 = std::max(out.start - 1, 0), e1 = std::min(out.end + 1, rows);
 
-    cv::cvtColor(dst, dst, cv::COLOR_GRAY2BGR);
+            mask.resize((size_t)(y1 - y0) * cols);
+            for (int y = y0; y < y1; ++y) {
+                table.hueRow(src.ptr<uchar>(y), hue.data(), cols);
+                uchar* m = &mask[(size_t)(y - y0) * cols];
+                for (int x = 0; x < cols; ++x) {
+                    m[x] = hue[x] > ithresh ? 1 : 0;
+                }
+            }
 
-    std::vector<cv::Vec3b> from = {cv::Vec3b(0, 0, 0), cv::Vec3b(255, 255, 255)};
-    std::vector<cv::Vec3b> to = {cv::Vec3b(255, 0, 255), cv::Vec3b(255, 255, 0)};
-    recolorImg(dst, from, to);
+            // erosion: minimum over the 3x3 neighbourhood inside the image
+            eroded.resize((size_t)(e1 - e0) * cols);
+            for (int y = e0; y < e1; ++y) {
+                const uchar* up = &mask[(size_t)(std::max(y - 1, 0) - y0) * cols];
+                const uchar* row = &mask[(size_t)(y - y0) * cols];
+                const uchar* down = &mask[(size_t)(std::min(y + 1, rows - 1) - y0) * cols];
+                uchar* e = &eroded[(size_t)(y - e0) * cols];
+                for (int x = 0; x < cols; ++x) {
+                    const int l = std::max(x - 1, 0), r = std::min(x + 1, cols - 1);
+                    e[x] = up[l] & up[x] & up[r] & row[l] & row[x] & row[r] & down[l] & down[x] & down[r];
+                }
+            }
+
+            // dilation: maximum over the 3x3 neighbourhood inside the image, then labels
+            for (int y = out.start; y < out.end; ++y) {
+                const uchar* up = &eroded[(size_t)(std::max(y - 1, 0) - e0) * cols];
+                const uchar* row = &eroded[(size_t)(y - e0) * cols];
+                const uchar* down = &eroded[(size_t)(std::min(y + 1, rows - 1) - e0) * cols];
+                uchar* d = dst.ptr<uchar>(y);
+                for (int x = 0; x < cols; ++x) {
+                    const int l = std::max(x - 1, 0), r = std::min(x + 1, cols - 1);
+                    const bool high = up[l] | up[x] | up[r] | row[l] | row[x] | row[r] | down[l] | down[x] | down[r];
+                    d[x] = high ? thresholdHighLabel : thresholdLowLabel;
+                }
+            }
+        }
+    });
 
     return dst;
 }
+
+} // namespace
+
+cv::Mat runThresholdBasedMethod(const cv::Mat& src) {
+    TRACE_SCOPE("threshold");
+    size_t hist[HUE_HIST_SIZE] = {};
+    accumulateHueHistogram(src, hist);
+
+    double hueThreshold;
+    {
+        TRACE_SCOPE("threshold/otsu");
+        hueThreshold = hueOtsuThreshold(hist);
+    }
+
+    return runThresholdBasedMethod(src, hueThreshold);
+}
+
+cv::Mat runThresholdBasedMethod(const cv::Mat& src, double hueThreshold) {
+    TRACE_SCOPE("threshold/labels");
+    return thresholdLabels(src, hueThreshold);
+}
+
+void accumulateHueHistogram(const cv::Mat& src, size_t hist[HUE_HIST_SIZE]) {
+    TRACE_SCOPE("threshold/histogram");
+    CV_Assert(src.type() == CV_8UC3);
+
+    // partial histogram per stripe, summed in stripe order
+    const int stripes = stripesCount(src.rows);
+    std::vector<size_t> partial((size_t)stripes * HUE_HIST_SIZE, 0);
+    const HueTable& table = hueTable();
+
+    cv::parallel_for_(cv::Range(0, stripes), [&](const cv::Range& range) {
+        std::vector<uchar> hue(src.cols);
+        for (int stripe = range.start; stripe < range.end; ++stripe) {
+            size_t* h = &partial[(size_t)stripe * HUE_HIST_SIZE];
+            const cv::Range rows = stripeRows(stripe, stripes, src.rows);
+            for (int y = rows.start; y < rows.end; ++y) {
+                table.hueRow(src.ptr<uchar>(y), hue.data(), src.cols);
+                for (int x = 0; x < src.cols; ++x) {
+                    h[hue[x]]++;
+                }
+            }
+        }
+    });
+
+    for (int stripe = 0; stripe < stripes; ++stripe) {
+        for (int i = 0; i < HUE_HIST_SIZE; ++i) {
+            hist[i] += partial[(size_t)stripe * HUE_HIST_SIZE + i];
+        }
+    }
+}
+
+double hueOtsuThreshold(const size_t hist[HUE_HIST_SIZE]) {
+    // the same computation as in cv::threshold, so results match bit to bit
+    double total = 0;
+    double mu = 0;
+    for (int i = 0; i < HUE_HIST_SIZE; ++i) {
+        total += hist[i];
+        mu += i * (double)hist[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    double scale = 1. / total;
+    mu *= scale;
+
+    double mu1 = 0, q1 = 0;
+    double max_sigma = 0, max_val = 0;
+
+    for (int i = 0; i < HUE_HIST_SIZE; ++i) {
+        double p_i, q2, mu2, sigma;
+
+        p_i = hist[i] * scale;
+        mu1 *= q1;
+        q1 += p_i;
+        q2 = 1. - q1;
+
+        if (std::min(q1, q2) < FLT_EPSILON || std::max(q1, q2) > 1. - FLT_EPSILON) {
+            continue;
+        }
+
+        mu1 = (mu1 + i * p_i) / q1;
+        mu2 = (mu - q1 * mu1) / q2;
+        sigma = q1 * q2 * (mu1 - mu2) * (mu1 - mu2);
+        if (sigma > max_sigma) {
+            max_sigma = sigma;
+            max_val = i;
+        }
+    }
+
+    return max_val;
+}
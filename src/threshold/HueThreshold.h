@@ -1,6 +1,18 @@
 #ifndef HUE_THRESHOLD_H
 #define HUE_THRESHOLD_H
 
+const int HUE_HIST_SIZE = 256;
+
 cv::Mat runThresholdBasedMethod(const cv::Mat& src);
 
+// Same as above with already known hue threshold,
+// lets parts of one image be processed separately
+cv::Mat runThresholdBasedMethod(const cv::Mat& src, double hueThreshold);
+
+// Adds hue values of src to hist
+void accumulateHueHistogram(const cv::Mat& src, size_t hist[HUE_HIST_SIZE]);
+
+// Otsu threshold of hue histogram, same value cv::threshold(..., THRESH_OTSU) gives for the whole image
+double hueOtsuThreshold(const size_t hist[HUE_HIST_SIZE]);
+
 #endif
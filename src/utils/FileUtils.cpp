@@ -0,0 +1,68 @@
+#include <iostream>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "FileUtils.h"
+
+bool file_exists(const std::string& name) {
+    return ( access( name.c_str(), F_OK ) != -1 );
+}
+
+bool is_directory(const std::string& name) {
+    struct stat st;
+    return stat(name.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+std::string removeExtention(const std::string& filename, bool verbose) {
+    const char* extentions[] = {".jpg", ".tif", ".tiff"};
+
+    for (size_t i = 0; i < sizeof(extentions) / sizeof(extentions[0]); ++i) {
+        const std::string ext(extentions[i]);
+        if ( filename != ext &&
+             filename.size() > ext.size() &&
+             filename.substr(filename.size() - ext.size()) == ext )
+        {
+            return filename.substr(0, filename.size() - ext.size());
+        }
+    }
+
+    if (verbose) {
+        std::cerr << "Can't remove extention" << std::endl;
+    }
+    return "";
+}
+
+std::string genMaskFileName(const std::string& filename) {
+    std::string pureFilename = removeExtention(filename);
+    if (pureFilename.empty()) {
+        return "";
+    }
+
+    return pureFilename + "_mask.png";
+}
+
+std::string genMarkersFileName(const std::string& filename) {
+    std::string pureFilename = removeExtention(filename);
+    if (pureFilename.empty()) {
+        return "";
+    }
+
+    return pureFilename + "_zMarkers.png";
+}
+
+std::string labelFileName(const std::string& pngFilename) {
+    const std::string ext(".png");
+    if (pngFilename.size() > ext.size() && pngFilename.substr(pngFilename.size() - ext.size()) == ext) {
+        return pngFilename.substr(0, pngFilename.size() - ext.size()) + ".lbl";
+    }
+    return pngFilename + ".lbl";
+}
+
+std::string pickLabelsFile(const std::string& pngFilename, bool labelFiles) {
+    const std::string preferred = labelFiles ? labelFileName(pngFilename) : pngFilename;
+    const std::string other = labelFiles ? pngFilename : labelFileName(pngFilename);
+    if (file_exists(preferred)) {
+        return preferred;
+    }
+    return file_exists(other) ? other : "";
+}
@@ -0,0 +1,24 @@
+#ifndef FILE_UTILS_H
+#define FILE_UTILS_H
+
+#include <string>
+
+bool file_exists(const std::string& name);
+
+bool is_directory(const std::string& name);
+
+// Strips .jpg / .tif / .tiff, returns empty string for other files
+std::string removeExtention(const std::string& filename, bool verbose = true);
+
+std::string genMaskFileName(const std::string& filename);
+
+std::string genMarkersFileName(const std::string& filename);
+
+// Name of the label file (see LabelFile.h) saved instead of a PNG file: x.png -> x.lbl
+std::string labelFileName(const std::string& pngFilename);
+
+// Of the PNG file and its label file, the one of the chosen format if it exists, otherwise the other one.
+// Empty string if neither exists.
+std::string pickLabelsFile(const std::string& pngFilename, bool labelFiles);
+
+#endif // FILE_UTILS_H
@@ -1,18 +1,138 @@
 #include <opencv2/core/utility.hpp>
 
-void recolorImg(cv::Mat& m, const std::vector<cv::Vec3b>& from, const std::vector<cv::Vec3b>& to)
+#include "ImageUtils.h"
+
+namespace {
+
+// key of an empty slot, packed colors use only 24 bits
+const unsigned EMPTY_KEY = 0xffffffffu;
+
+inline unsigned packColor(const uchar* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+inline unsigned hashColor(unsigned color) {
+    return (color * 2654435761u) >> 8;
+}
+
+} // namespace
+
+ColorMap::ColorMap(const std::vector<cv::Vec3b>& from, const std::vector<cv::Vec3b>& to)
+{
+    CV_Assert(from.size() == to.size());
+
+    size_t capacity = 16;
+    while (capacity < 2 * from.size()) {
+        capacity *= 2;
+    }
+    keys_.assign(capacity, EMPTY_KEY);
+    values_.assign(capacity, cv::Vec3b());
+    mask_ = (unsigned)capacity - 1;
+
+    for (size_t k = 0; k < from.size(); ++k) {
+        unsigned color = packColor(from[k].val);
+        unsigned slot = hashColor(color) & mask_;
+        while (keys_[slot] != EMPTY_KEY && keys_[slot] != color) {
+            slot = (slot + 1) & mask_;
+        }
+        if (keys_[slot] == EMPTY_KEY) {
+            keys_[slot] = color;
+            values_[slot] = to[k];
+        }
+    }
+}
+
+inline bool ColorMap::lookup(unsigned color, cv::Vec3b& result) const
 {
-    assert(from.size() == to.size());
-    for (size_t i = 0; i < m.rows; ++i) {
-        for (size_t j = 0; j < m.cols; ++j) {
-            auto cur_col = m.at<cv::Vec3b>(i, j);
-
-            for (size_t k = 0; k < from.size(); ++k) {
-                if (cur_col == from[k]) {
-                    m.at<cv::Vec3b>(i, j) = to[k];
-                    break;
+    for (unsigned slot = hashColor(color) & mask_; keys_[slot] != EMPTY_KEY; slot = (slot + 1) & mask_) {
+        if (keys_[slot] == color) {
+            result = values_[slot];
+            return true;
+        }
+    }
+    return false;
+}
+
+void ColorMap::apply(cv::Mat& m) const
+{
+    CV_Assert(m.type() == CV_8UC3);
+
+    cv::parallel_for_(cv::Range(0, m.rows), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end; ++i) {
+            uchar* row = m.ptr<uchar>(i);
+
+            // masks are mostly long runs of one color, look it up once per run
+            unsigned runColor = EMPTY_KEY;
+            bool runMapped = false;
+            cv::Vec3b runResult;
+
+            for (int j = 0; j < m.cols; ++j) {
+                uchar* p = row + j * 3;
+                unsigned color = packColor(p);
+                if (color != runColor) {
+                    runColor = color;
+                    runMapped = lookup(color, runResult);
+                }
+                if (runMapped) {
+                    p[0] = runResult[0];
+                    p[1] = runResult[1];
+                    p[2] = runResult[2];
                 }
             }
         }
+    });
+}
+
+void recolorImg(cv::Mat& m, const std::vector<cv::Vec3b>& from, const std::vector<cv::Vec3b>& to)
+{
+    ColorMap(from, to).apply(m);
+}
+
+void relabelImg(cv::Mat& m, const std::vector<uchar>& from, const std::vector<uchar>& to)
+{
+    CV_Assert(from.size() == to.size());
+    CV_Assert(m.type() == CV_8U);
+
+    cv::Mat table(1, 256, CV_8U);
+    uchar* lut = table.ptr<uchar>();
+    for (int k = 0; k < 256; ++k) {
+        lut[k] = (uchar)k;
+    }
+    // first mapping wins, as in recolorImg
+    for (size_t k = from.size(); k-- > 0; ) {
+        lut[from[k]] = to[k];
     }
+
+    // element-wise, so it's safe in place
+    cv::LUT(m, table, m);
+}
+
+void overlayMarkers(const cv::Mat& img0, const cv::Mat& markerMask, cv::Mat& dst, const cv::Vec3b& color)
+{
+    dst.create(img0.size(), CV_8UC3);
+    overlayMarkers(img0, markerMask, dst, color, cv::Rect(0, 0, img0.cols, img0.rows));
+}
+
+void overlayMarkers(const cv::Mat& img0, const cv::Mat& markerMask, cv::Mat& dst, const cv::Vec3b& color,
+                    const cv::Rect& rect)
+{
+    CV_Assert(img0.type() == CV_8UC3 && markerMask.type() == CV_8U && dst.type() == CV_8UC3);
+    CV_Assert(img0.size() == markerMask.size() && img0.size() == dst.size());
+
+    const cv::Rect area = rect & cv::Rect(0, 0, img0.cols, img0.rows);
+
+    cv::parallel_for_(cv::Range(area.y, area.y + area.height), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end; ++i) {
+            const uchar* src = img0.ptr<uchar>(i) + area.x * 3;
+            const uchar* markers = markerMask.ptr<uchar>(i) + area.x;
+            uchar* row = dst.ptr<uchar>(i) + area.x * 3;
+            // branchless select, so the compiler can vectorize it
+            for (int j = 0; j < area.width; ++j) {
+                const bool marked = markers[j] == 255;
+                row[j * 3] = marked ? color[0] : src[j * 3];
+                row[j * 3 + 1] = marked ? color[1] : src[j * 3 + 1];
+                row[j * 3 + 2] = marked ? color[2] : src[j * 3 + 2];
+            }
+        }
+    });
 }
@@ -3,6 +3,34 @@
 
 #include "opencv2/imgproc.hpp"
 
+// from -> to mapping of BGR colors compiled once and applied to whole images,
+// cost per pixel doesn't depend on the number of mappings. First mapping of a color wins.
+class ColorMap {
+public:
+    ColorMap(const std::vector<cv::Vec3b>& from, const std::vector<cv::Vec3b>& to);
+
+    // Recolors CV_8UC3 image in place, rows in parallel
+    void apply(cv::Mat& m) const;
+
+private:
+    bool lookup(unsigned color, cv::Vec3b& result) const;
+
+    // open addressing table of packed colors, capacity is a power of 2 and at least twice the size
+    std::vector<unsigned> keys_;
+    std::vector<cv::Vec3b> values_;
+    unsigned mask_;
+};
+
 void recolorImg(cv::Mat& m, const std::vector<cv::Vec3b>& from, const std::vector<cv::Vec3b>& to);
 
+// Same as recolorImg, but for single-channel label masks, in place through a 256 entry table
+void relabelImg(cv::Mat& m, const std::vector<uchar>& from, const std::vector<uchar>& to);
+
+// dst = img0 (CV_8UC3) with pixels drawn on markerMask (CV_8U, 255) painted with color
+void overlayMarkers(const cv::Mat& img0, const cv::Mat& markerMask, cv::Mat& dst, const cv::Vec3b& color);
+
+// Same as above, but recomposites only rect of already allocated dst
+void overlayMarkers(const cv::Mat& img0, const cv::Mat& markerMask, cv::Mat& dst, const cv::Vec3b& color,
+                    const cv::Rect& rect);
+
 #endif
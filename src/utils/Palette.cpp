@@ -0,0 +1,191 @@
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "Palette.h"
+#include "ColorTypesExtensions.h"
+
+namespace {
+
+inline unsigned packColor(const cv::Vec3b& c) {
+    return c[0] | (c[1] << 8) | (c[2] << 16);
+}
+
+struct Palette {
+    Palette() {
+        // terrain
+        colors[justTerrainLabel] = cvScalar2Vec3b(CV_RGB(102, 51, 0));
+        colors[snowLabel] = cvScalar2Vec3b(CV_RGB(204, 255, 255));
+        colors[sandLabel] = cvScalar2Vec3b(CV_RGB(255, 255, 51));
+        colors[forestLabel] = cvScalar2Vec3b(CV_RGB(0, 102, 0));
+        colors[grassLabel] = cvScalar2Vec3b(CV_RGB(51, 255, 51));
+
+        colors[roadsLabel] = cvScalar2Vec3b(CV_RGB(160, 160, 160));
+
+        colors[buildingsLabel] = cvScalar2Vec3b(CV_RGB(96, 96, 96));
+
+        colors[waterLabel] = cvScalar2Vec3b(CV_RGB(0, 128, 255));
+
+        colors[cloudsLabel] = cvScalar2Vec3b(CV_RGB(224, 224, 224));
+
+        colors[unknownLabel] = cvScalar2Vec3b(CV_RGB(0, 0, 0));
+
+        colors[notSpecifiedLabel] = cvScalar2Vec3b(CV_RGB(255, 0, 0));
+
+        colors[thresholdLowLabel] = cv::Vec3b(255, 0, 255);
+        colors[thresholdHighLabel] = cv::Vec3b(255, 255, 0);
+        colors[boundaryLabel] = cv::Vec3b(255, 255, 255);
+
+        for (int label = boundaryLabel + 1; label < firstRegionLabel; ++label) {
+            colors[label] = cv::Vec3b(0, 0, 0);
+        }
+
+        for (int label = 0; label < firstRegionLabel; ++label) {
+            byColor[packColor(colors[label])] = label;
+        }
+        // unused labels share black with "unknown"
+        byColor[packColor(colors[unknownLabel])] = unknownLabel;
+
+        // fixed seed, so saved masks can be loaded back with the same labels
+        cv::RNG rng(0x5e9);
+        for (int label = firstRegionLabel; label < LABEL_COUNT; ++label) {
+            cv::Vec3b color;
+            do {
+                color = cv::Vec3b((uchar)rng.uniform(0, 256), (uchar)rng.uniform(0, 256), (uchar)rng.uniform(0, 256));
+            } while (byColor.count(packColor(color)));
+
+            colors[label] = color;
+            byColor[packColor(color)] = label;
+        }
+    }
+
+    cv::Vec3b colors[LABEL_COUNT];
+    std::unordered_map<unsigned, uchar> byColor;
+};
+
+const Palette& palette() {
+    static const Palette instance;
+    return instance;
+}
+
+} // namespace
+
+void initLabelSet(LabelSet& labels) {
+    labels.set();
+    labels.reset(notSpecifiedLabel);
+}
+
+const cv::Vec3b& labelColor(uchar label) {
+    return palette().colors[label];
+}
+
+const char* labelName(uchar label) {
+    static const char* const names[] = {
+        "terrain", "snow", "sand", "forest", "grass", "roads", "buildings", "water", "clouds",
+        "unknown", "not specified", "threshold low", "threshold high", "boundary"
+    };
+    if (label < sizeof(names) / sizeof(names[0])) {
+        return names[label];
+    }
+    return label >= firstRegionLabel ? "region" : "unused";
+}
+
+const cv::Vec3b* labelColors() {
+    return palette().colors;
+}
+
+void colorizeLabels(const cv::Mat& labels, cv::Mat& colors) {
+    CV_Assert(labels.type() == CV_8U);
+
+    const cv::Vec3b* table = palette().colors;
+    colors.create(labels.size(), CV_8UC3);
+
+    for (int i = 0; i < labels.rows; ++i) {
+        const uchar* src = labels.ptr<uchar>(i);
+        cv::Vec3b* dst = colors.ptr<cv::Vec3b>(i);
+        for (int j = 0; j < labels.cols; ++j) {
+            dst[j] = table[src[j]];
+        }
+    }
+}
+
+bool labelsFromColors(const cv::Mat& colors, cv::Mat& labels) {
+    CV_Assert(colors.type() == CV_8UC3);
+
+    std::unordered_map<unsigned, uchar> byColor = palette().byColor;
+
+    // colors of other palettes in the order they appear and the colors touching them
+    std::vector<unsigned> foreign;
+    std::unordered_map<unsigned, std::set<unsigned> > neighbours;
+    for (int i = 0; i < colors.rows; ++i) {
+        const cv::Vec3b* src = colors.ptr<cv::Vec3b>(i);
+        const cv::Vec3b* up = i > 0 ? colors.ptr<cv::Vec3b>(i - 1) : 0;
+        for (int j = 0; j < colors.cols; ++j) {
+            const unsigned color = packColor(src[j]);
+            const unsigned left = j > 0 ? packColor(src[j - 1]) : color;
+            const unsigned above = up ? packColor(up[j]) : color;
+            if (left == color && above == color && j > 0) {
+                continue;
+            }
+            if (!byColor.count(color) && !neighbours.count(color)) {
+                foreign.push_back(color);
+                neighbours[color];
+            }
+            const unsigned touching[2] = {left, above};
+            for (int k = 0; k < 2; ++k) {
+                if (touching[k] == color) {
+                    continue;
+                }
+                if (neighbours.count(color)) {
+                    neighbours[color].insert(touching[k]);
+                }
+                if (neighbours.count(touching[k])) {
+                    neighbours[touching[k]].insert(color);
+                }
+            }
+        }
+    }
+
+    // Every foreign color gets its own region label while there are free ones, then labels are shared
+    // by colors which don't touch, the same way watershed regions get them (see pickRegionLabel)
+    for (size_t c = 0; c < foreign.size(); ++c) {
+        std::bitset<REGION_LABEL_COUNT> used;
+        const std::set<unsigned>& touching = neighbours[foreign[c]];
+        for (std::set<unsigned>::const_iterator it = touching.begin(); it != touching.end(); ++it) {
+            std::unordered_map<unsigned, uchar>::const_iterator label = byColor.find(*it);
+            if (label != byColor.end() && label->second >= firstRegionLabel) {
+                used.set(label->second - firstRegionLabel);
+            }
+        }
+
+        int slot = (int)(c % REGION_LABEL_COUNT);
+        for (int k = 0; k < REGION_LABEL_COUNT && used[slot]; k++) {
+            slot = (slot + 1) % REGION_LABEL_COUNT;
+        }
+        if (used[slot]) {
+            // touches regions of all region labels
+            labels.release();
+            return false;
+        }
+        byColor[foreign[c]] = (uchar)(firstRegionLabel + slot);
+    }
+
+    labels.create(colors.size(), CV_8U);
+    for (int i = 0; i < colors.rows; ++i) {
+        const cv::Vec3b* src = colors.ptr<cv::Vec3b>(i);
+        uchar* dst = labels.ptr<uchar>(i);
+
+        // masks consist of long runs of the same color
+        unsigned prevColor = packColor(src[0]) + 1;
+        uchar prevLabel = 0;
+        for (int j = 0; j < colors.cols; ++j) {
+            unsigned color = packColor(src[j]);
+            if (color != prevColor) {
+                prevLabel = byColor[color];
+                prevColor = color;
+            }
+            dst[j] = prevLabel;
+        }
+    }
+    return true;
+}
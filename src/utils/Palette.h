@@ -0,0 +1,73 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include "opencv2/imgproc.hpp"
+
+#include <bitset>
+
+// Masks are stored as single-channel CV_8U label images,
+// colors are only used to display and to save them.
+
+// terrain
+const uchar justTerrainLabel = 0;
+const uchar snowLabel = 1;
+const uchar sandLabel = 2;
+const uchar forestLabel = 3;
+const uchar grassLabel = 4;
+
+const uchar roadsLabel = 5;
+
+const uchar buildingsLabel = 6;
+
+const uchar waterLabel = 7;
+
+const uchar cloudsLabel = 8;
+
+const uchar unknownLabel = 9;
+
+const uchar notSpecifiedLabel = 10;
+
+// number of labels user can assign
+const int CLASS_COUNT = 11;
+
+// hue threshold output (violet and cyan), has to be replaced by user with some class
+const uchar thresholdLowLabel = 11;
+const uchar thresholdHighLabel = 12;
+
+// watershed boundaries between regions (white)
+const uchar boundaryLabel = 13;
+
+// watershed regions which are not assigned to any class yet,
+// every label in [firstRegionLabel, LABEL_COUNT) has its own random color
+const uchar firstRegionLabel = 16;
+
+const int LABEL_COUNT = 256;
+const int REGION_LABEL_COUNT = LABEL_COUNT - firstRegionLabel;
+
+typedef std::bitset<CLASS_COUNT> LabelSet;
+
+inline bool isValidLabel(const LabelSet& labels, uchar label) {
+    return label < CLASS_COUNT && labels[label];
+}
+
+// every class except "not specified"
+void initLabelSet(LabelSet& labels);
+
+const cv::Vec3b& labelColor(uchar label);
+
+// short name of a class or special label ("forest", "threshold low", ...), "region" for region labels
+const char* labelName(uchar label);
+
+// colors of all LABEL_COUNT labels indexed by label
+const cv::Vec3b* labelColors();
+
+// labels (CV_8U) -> BGR image (CV_8UC3)
+void colorizeLabels(const cv::Mat& labels, cv::Mat& colors);
+
+// BGR image (CV_8UC3) -> labels (CV_8U),
+// colors which are not in palette are treated as unassigned watershed regions: they get region labels
+// so that touching regions never share one. Returns false (labels are empty) if a color touches
+// regions of all REGION_LABEL_COUNT region labels.
+bool labelsFromColors(const cv::Mat& colors, cv::Mat& labels);
+
+#endif // PALETTE_H
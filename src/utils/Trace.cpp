@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include "Trace.h"
+
+namespace {
+
+struct TraceEvent {
+    const char* name;
+    int thread;
+    double startUs;
+    double durationUs;
+    // resident set size of the process at the scope ends and its peak so far
+    size_t startRss;
+    size_t endRss;
+    size_t startPeakRss;
+    size_t endPeakRss;
+};
+
+struct Tracer {
+    Tracer() : enabled(false), start(std::chrono::steady_clock::now()) {}
+
+    std::atomic<bool> enabled;
+    std::chrono::steady_clock::time_point start;
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+};
+
+Tracer& tracer() {
+    static Tracer instance;
+    return instance;
+}
+
+double nowUs() {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - tracer().start).count();
+}
+
+int threadIndex() {
+    static std::atomic<int> threadsCount(0);
+    static thread_local int index = threadsCount++;
+    return index;
+}
+
+size_t currentRss() {
+#ifdef __linux__
+    long pages = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (!statm) {
+        return 0;
+    }
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+size_t peakRss() {
+#ifdef __linux__
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (size_t)usage.ru_maxrss * 1024;
+#else
+    return 0;
+#endif
+}
+
+double toMB(size_t bytes) {
+    return bytes / (1024. * 1024.);
+}
+
+} // namespace
+
+std::string jsonString(const char* s) {
+    std::string result = "\"";
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            result += '\\';
+            result += *s;
+        } else if ((unsigned char)*s < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*s);
+            result += escaped;
+        } else {
+            result += *s;
+        }
+    }
+    return result + "\"";
+}
+
+void enableTracing(bool enabled) {
+    tracer().enabled = enabled;
+}
+
+bool tracingEnabled() {
+    return tracer().enabled;
+}
+
+void clearTrace() {
+    std::lock_guard<std::mutex> lock(tracer().mutex);
+    tracer().events.clear();
+}
+
+bool writeChromeTrace(const std::string& filename) {
+    std::ofstream out(filename.c_str());
+    if (!out) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(tracer().mutex);
+    const std::vector<TraceEvent>& events = tracer().events;
+
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+    for (size_t i = 0; i < events.size(); ++i) {
+        const TraceEvent& e = events[i];
+        out << (i ? ",\n" : "\n")
+            << "{\"name\":" << jsonString(e.name) << ",\"cat\":\"stage\",\"ph\":\"X\""
+            << ",\"ts\":" << e.startUs << ",\"dur\":" << e.durationUs
+            << ",\"pid\":1,\"tid\":" << e.thread
+            << ",\"args\":{\"rssMB\":" << toMB(e.endRss)
+            << ",\"rssDeltaMB\":" << toMB(e.endRss) - toMB(e.startRss)
+            << ",\"peakRssMB\":" << toMB(e.endPeakRss) << "}}";
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    return (bool)out;
+}
+
+void printTraceSummary(std::ostream& out) {
+    struct StageSummary {
+        StageSummary() : calls(0), totalUs(0), maxUs(0), maxRssGrowth(0), maxPeakGrowth(0), peak(0) {}
+
+        size_t calls;
+        double totalUs, maxUs;
+        // how much a single call grew resident memory and raised the process peak
+        double maxRssGrowth, maxPeakGrowth;
+        size_t peak;
+    };
+
+    std::map<std::string, StageSummary> stages;
+    {
+        std::lock_guard<std::mutex> lock(tracer().mutex);
+        const std::vector<TraceEvent>& events = tracer().events;
+        for (size_t i = 0; i < events.size(); ++i) {
+            const TraceEvent& e = events[i];
+            StageSummary& s = stages[e.name];
+            s.calls++;
+            s.totalUs += e.durationUs;
+            s.maxUs = std::max(s.maxUs, e.durationUs);
+            s.maxRssGrowth = std::max(s.maxRssGrowth, toMB(e.endRss) - toMB(e.startRss));
+            s.maxPeakGrowth = std::max(s.maxPeakGrowth, toMB(e.endPeakRss) - toMB(e.startPeakRss));
+            s.peak = std::max(s.peak, e.endPeakRss);
+        }
+    }
+
+    std::ios::fmtflags flags = out.flags();
+    out << std::left << std::setw(28) << "stage" << std::right
+        << std::setw(8) << "calls" << std::setw(12) << "total ms" << std::setw(10) << "mean ms"
+        << std::setw(10) << "max ms" << std::setw(12) << "+rss MB" << std::setw(12) << "+peak MB"
+        << std::setw(12) << "peak MB" << "\n";
+
+    out << std::fixed << std::setprecision(2);
+    for (std::map<std::string, StageSummary>::const_iterator it = stages.begin(); it != stages.end(); ++it) {
+        const StageSummary& s = it->second;
+        out << std::left << std::setw(28) << it->first << std::right
+            << std::setw(8) << s.calls << std::setw(12) << s.totalUs / 1000.
+            << std::setw(10) << s.totalUs / 1000. / s.calls << std::setw(10) << s.maxUs / 1000.
+            << std::setw(12) << s.maxRssGrowth << std::setw(12) << s.maxPeakGrowth
+            << std::setw(12) << toMB(s.peak) << "\n";
+    }
+    out.flush();
+    out.flags(flags);
+}
+
+TraceScope::TraceScope(const char* name)
+    : name_(name)
+    , active_(tracer().enabled)
+    , startUs_(0)
+    , startRss_(0)
+    , startPeakRss_(0)
+{
+    if (active_) {
+        startRss_ = currentRss();
+        startPeakRss_ = peakRss();
+        startUs_ = nowUs();
+    }
+}
+
+TraceScope::~TraceScope() {
+    if (!active_) {
+        return;
+    }
+
+    TraceEvent e;
+    e.name = name_;
+    e.thread = threadIndex();
+    e.startUs = startUs_;
+    e.durationUs = nowUs() - startUs_;
+    e.startRss = startRss_;
+    e.endRss = currentRss();
+    e.startPeakRss = startPeakRss_;
+    e.endPeakRss = peakRss();
+
+    std::lock_guard<std::mutex> lock(tracer().mutex);
+    tracer().events.push_back(e);
+}
@@ -0,0 +1,46 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <ostream>
+#include <string>
+
+// Stage-level tracing. Scopes are recorded only while tracing is enabled,
+// otherwise TRACE_SCOPE costs one atomic load.
+void enableTracing(bool enabled);
+bool tracingEnabled();
+
+// Drops everything recorded so far
+void clearTrace();
+
+// Chrome / Perfetto trace event JSON ("X" events, one track per thread)
+bool writeChromeTrace(const std::string& filename);
+
+// Per stage table: calls, total / mean / max time, memory
+void printTraceSummary(std::ostream& out);
+
+// Quoted JSON string literal of s, which can contain anything (names, file paths)
+std::string jsonString(const char* s);
+
+// Records time of its lifetime and memory of the process at its ends.
+// name has to be a string literal or outlive the trace.
+class TraceScope {
+public:
+    explicit TraceScope(const char* name);
+    ~TraceScope();
+
+private:
+    TraceScope(const TraceScope&);
+    TraceScope& operator=(const TraceScope&);
+
+    const char* name_;
+    bool active_;
+    double startUs_;
+    size_t startRss_;
+    size_t startPeakRss_;
+};
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+
+#endif // TRACE_H
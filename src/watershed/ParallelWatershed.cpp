@@ -0,0 +1,389 @@
+#include "opencv2/core/utility.hpp"
+
+#include <iostream>
+
+#include "ParallelWatershed.h"
+#include "PyramidWatershed.h"
+
+namespace {
+
+const int WSHED = -1;
+const int IN_QUEUE = -2;
+const int NQ = 256;
+
+// rows of a strip have to be farther than 1 pixel from its seams
+const int MIN_STRIP_HEIGHT = 8;
+
+inline int colorDiff(const uchar* p1, const uchar* p2) {
+    int b = std::abs(p1[0] - p2[0]);
+    int g = std::abs(p1[1] - p2[1]);
+    int r = std::abs(p1[2] - p2[2]);
+    return std::max(std::max(b, g), r);
+}
+
+// Priority queue of pixel offsets, FIFO within one priority
+class FloodQueue {
+public:
+    FloodQueue() : active_(NQ) {
+        std::fill(heads_, heads_ + NQ, 0);
+    }
+
+    void push(int priority, int ofs) {
+        buckets_[priority].push_back(ofs);
+        active_ = std::min(active_, priority);
+    }
+
+    // lowest priority of queued pixels, NQ if there are none
+    int top() {
+        while (active_ < NQ && heads_[active_] == buckets_[active_].size()) {
+            buckets_[active_].clear();
+            heads_[active_] = 0;
+            active_++;
+        }
+        return active_;
+    }
+
+    int pop() {
+        return buckets_[active_][heads_[active_]++];
+    }
+
+    template<typename F>
+    void forEach(F f) const {
+        for (int q = 0; q < NQ; ++q) {
+            for (size_t k = heads_[q]; k < buckets_[q].size(); ++k) {
+                f(buckets_[q][k]);
+            }
+        }
+    }
+
+private:
+    std::vector<int> buckets_[NQ];
+    size_t heads_[NQ];
+    int active_;
+};
+
+// Splits the inner rows [1, rows - 1) of a markers image into at most stripsCnt strips of equal height,
+// returns the height, stripsCnt gets the actual number of strips
+int splitIntoStrips(int rows, int& stripsCnt) {
+    const int innerRows = rows - 2;
+    stripsCnt = std::max(1, std::min(stripsCnt, innerRows / MIN_STRIP_HEIGHT));
+    const int stripHeight = (innerRows + stripsCnt - 1) / stripsCnt;
+    stripsCnt = (innerRows + stripHeight - 1) / stripHeight;
+    return stripHeight;
+}
+
+struct Strip {
+    // rows [y0, y1)
+    int y0, y1;
+    FloodQueue queue;
+    // popped seam pixels left for the sequential step
+    std::vector<int> deferred;
+};
+
+class StripFlooder {
+public:
+    StripFlooder(const cv::Mat& img, cv::Mat& markers, int stripsCnt)
+        : img_(img)
+        , markers_(markers)
+        , m0_(markers.ptr<int>())
+        , mstep_((int)markers.step1())
+        , i0_(img.ptr<uchar>())
+        , istep_((int)img.step)
+    {
+        // the outer frame is never flooded, so inner rows are [1, rows - 1)
+        stripHeight_ = splitIntoStrips(markers.rows, stripsCnt);
+
+        strips_.resize(stripsCnt);
+        for (int s = 0; s < stripsCnt; ++s) {
+            strips_[s].y0 = 1 + s * stripHeight_;
+            strips_[s].y1 = std::min(markers.rows - 1, strips_[s].y0 + stripHeight_);
+        }
+    }
+
+    void run() {
+        init();
+
+        // A round floods whole level in every strip, so rounds are needed only while flooding
+        // crosses seams back and forth, not one per step of the FIFO order
+        for (int level = 0; level < NQ; ++level) {
+            for (;;) {
+                cv::parallel_for_(cv::Range(0, (int)strips_.size()), [&](const cv::Range& range) {
+                    for (int s = range.start; s < range.end; ++s) {
+                        floodStrip(strips_[s], level);
+                    }
+                });
+
+                // seam pixels see both strips, settle them one by one
+                for (size_t s = 0; s < strips_.size(); ++s) {
+                    std::vector<int>& deferred = strips_[s].deferred;
+                    for (size_t k = 0; k < deferred.size(); ++k) {
+                        settle(deferred[k]);
+                    }
+                    deferred.clear();
+                }
+
+                bool pending = false;
+                for (size_t s = 0; s < strips_.size() && !pending; ++s) {
+                    pending = strips_[s].queue.top() <= level;
+                }
+                if (!pending) {
+                    break;
+                }
+            }
+        }
+    }
+
+private:
+    void init() {
+        const int rows = markers_.rows, cols = markers_.cols;
+
+        for (int j = 0; j < cols; ++j) {
+            m0_[j] = m0_[(rows - 1) * mstep_ + j] = WSHED;
+        }
+
+        cv::parallel_for_(cv::Range(0, (int)strips_.size()), [&](const cv::Range& range) {
+            for (int s = range.start; s < range.end; ++s) {
+                for (int i = strips_[s].y0; i < strips_[s].y1; ++i) {
+                    int* m = m0_ + i * mstep_;
+                    m[0] = m[cols - 1] = WSHED;
+                    for (int j = 1; j < cols - 1; ++j) {
+                        if (m[j] < 0) {
+                            m[j] = 0;
+                        }
+                    }
+                }
+            }
+        });
+
+        // Neighbours on the other side of a seam are read here, so queued pixels are marked
+        // only after all strips are scanned, otherwise a strip would write IN_QUEUE into rows
+        // its neighbour is still reading
+        cv::parallel_for_(cv::Range(0, (int)strips_.size()), [&](const cv::Range& range) {
+            for (int s = range.start; s < range.end; ++s) {
+                for (int i = strips_[s].y0; i < strips_[s].y1; ++i) {
+                    const int* m = m0_ + i * mstep_;
+                    const uchar* ptr = i0_ + i * istep_;
+                    for (int j = 1; j < cols - 1; ++j) {
+                        if (m[j] != 0 || !(m[j - 1] > 0 || m[j + 1] > 0 || m[j - mstep_] > 0 || m[j + mstep_] > 0)) {
+                            continue;
+                        }
+
+                        const uchar* p = ptr + j * 3;
+                        int idx = NQ;
+                        if (m[j - 1] > 0) idx = std::min(idx, colorDiff(p, p - 3));
+                        if (m[j + 1] > 0) idx = std::min(idx, colorDiff(p, p + 3));
+                        if (m[j - mstep_] > 0) idx = std::min(idx, colorDiff(p, p - istep_));
+                        if (m[j + mstep_] > 0) idx = std::min(idx, colorDiff(p, p + istep_));
+
+                        strips_[s].queue.push(idx, i * mstep_ + j);
+                    }
+                }
+            }
+        });
+
+        cv::parallel_for_(cv::Range(0, (int)strips_.size()), [&](const cv::Range& range) {
+            int* m0 = m0_;
+            for (int s = range.start; s < range.end; ++s) {
+                strips_[s].queue.forEach([m0](int ofs) { m0[ofs] = IN_QUEUE; });
+            }
+        });
+    }
+
+    FloodQueue& queueOf(int ofs) {
+        int y = ofs / mstep_;
+        return strips_[std::min((y - 1) / stripHeight_, (int)strips_.size() - 1)].queue;
+    }
+
+    bool isSeamRow(const Strip& strip, int y) const {
+        return (y == strip.y0 && strip.y0 > 1) || (y == strip.y1 - 1 && strip.y1 < markers_.rows - 1);
+    }
+
+    // Floods everything the strip can reach up to level, seams are left for the sequential step
+    void floodStrip(Strip& strip, int level) {
+        while (strip.queue.top() <= level) {
+            int ofs = strip.queue.pop();
+            if (isSeamRow(strip, ofs / mstep_)) {
+                strip.deferred.push_back(ofs);
+                continue;
+            }
+            settle(ofs, &strip.queue);
+        }
+    }
+
+    // Labels popped pixel and queues its unlabeled neighbours, the same way cv::watershed does.
+    // Without queue neighbours go to queues of their strips.
+    void settle(int ofs, FloodQueue* queue = 0) {
+        int* m = m0_ + ofs;
+        const int y = ofs / mstep_, x = ofs - y * mstep_;
+        const uchar* ptr = i0_ + y * istep_ + x * 3;
+
+        // Check if any neighbors are labeled
+        int lab = 0, t;
+        t = m[-1]; if (t > 0) lab = t;
+        t = m[1]; if (t > 0) { if (lab == 0) lab = t; else if (t != lab) lab = WSHED; }
+        t = m[-mstep_]; if (t > 0) { if (lab == 0) lab = t; else if (t != lab) lab = WSHED; }
+        t = m[mstep_]; if (t > 0) { if (lab == 0) lab = t; else if (t != lab) lab = WSHED; }
+
+        CV_Assert(lab != 0);
+        m[0] = lab;
+        if (lab == WSHED) {
+            return;
+        }
+
+        // Add unlabeled neighbors to the queue
+        const int offsets[4] = {-1, 1, -mstep_, mstep_};
+        const int imgOffsets[4] = {-3, 3, -istep_, istep_};
+        for (int k = 0; k < 4; ++k) {
+            if (m[offsets[k]] == 0) {
+                int priority = colorDiff(ptr, ptr + imgOffsets[k]);
+                (queue ? *queue : queueOf(ofs + offsets[k])).push(priority, ofs + offsets[k]);
+                m[offsets[k]] = IN_QUEUE;
+            }
+        }
+    }
+
+    const cv::Mat& img_;
+    cv::Mat& markers_;
+    int* m0_;
+    int mstep_;
+    const uchar* i0_;
+    int istep_;
+    int stripHeight_;
+    std::vector<Strip> strips_;
+};
+
+} // namespace
+
+void parallelWatershed(const cv::Mat& img, cv::Mat& markers, int strips) {
+    CV_Assert(img.type() == CV_8UC3 && markers.type() == CV_32S && img.size() == markers.size());
+
+    if (markers.rows < 3 || markers.cols < 3) {
+        cv::watershed(img, markers);
+        return;
+    }
+
+    StripFlooder flooder(img, markers, strips > 0 ? strips : cv::getNumThreads());
+    flooder.run();
+}
+
+namespace {
+
+// returns the fraction of pixels flooded at full resolution
+double runEngine(const cv::Mat& img, cv::Mat& markers, const WatershedOptions& options) {
+    switch (options.engine) {
+    case PARALLEL_WATERSHED:
+        parallelWatershed(img, markers);
+        return 1.;
+    case PYRAMID_WATERSHED:
+        return pyramidWatershed(img, markers, options.pyramidLevels, options.pyramidBand);
+    default:
+        cv::watershed(img, markers);
+        return 1.;
+    }
+}
+
+// Where pixels disagreeing with cv::watershed are: within a row of a strip seam of parallelWatershed,
+// on plateaus (the same color as a 4-neighbour, where the order of equal priorities decides)
+// or elsewhere
+void printMismatches(const cv::Mat& img, const cv::Mat& reference, const cv::Mat& markers, bool parallel) {
+    std::vector<bool> nearSeam(markers.rows, false);
+    if (parallel) {
+        int stripsCnt = cv::getNumThreads();
+        const int stripHeight = splitIntoStrips(markers.rows, stripsCnt);
+        for (int s = 1; s < stripsCnt; ++s) {
+            const int seam = 1 + s * stripHeight;
+            for (int i = std::max(0, seam - 2); i <= std::min(markers.rows - 1, seam + 1); ++i) {
+                nearSeam[i] = true;
+            }
+        }
+    }
+
+    size_t seams = 0, plateaus = 0, other = 0;
+    for (int i = 0; i < markers.rows; ++i) {
+        const int* row1 = reference.ptr<int>(i);
+        const int* row2 = markers.ptr<int>(i);
+        const uchar* p = img.ptr<uchar>(i);
+        for (int j = 0; j < markers.cols; ++j) {
+            if (row1[j] == row2[j]) {
+                continue;
+            }
+            if (nearSeam[i]) {
+                seams++;
+                continue;
+            }
+            const uchar* c = p + j * 3;
+            const bool plateau = (j > 0 && colorDiff(c, c - 3) == 0) ||
+                                 (j + 1 < markers.cols && colorDiff(c, c + 3) == 0) ||
+                                 (i > 0 && colorDiff(c, c - img.step) == 0) ||
+                                 (i + 1 < markers.rows && colorDiff(c, c + img.step) == 0);
+            (plateau ? plateaus : other)++;
+        }
+    }
+
+    const double total = std::max<size_t>(1, seams + plateaus + other);
+    std::cout << "Watershed mismatches: " << seams + plateaus + other << " pixels, ";
+    if (parallel) {
+        std::cout << seams * 100 / total << "% near strip seams, ";
+    }
+    std::cout << plateaus * 100 / total << "% on plateaus, " << other * 100 / total << "% elsewhere" << std::endl;
+}
+
+const char* engineName(WatershedEngine engine) {
+    switch (engine) {
+    case PARALLEL_WATERSHED:
+        return "parallel";
+    case PYRAMID_WATERSHED:
+        return "pyramid";
+    default:
+        return "opencv";
+    }
+}
+
+} // namespace
+
+void floodWatershed(const cv::Mat& img, cv::Mat& markers, const WatershedOptions& options) {
+    if (!options.validate) {
+        runEngine(img, markers, options);
+        return;
+    }
+
+    cv::Mat reference = markers.clone();
+
+    double t = (double)cv::getTickCount();
+    cv::watershed(img, reference);
+    double referenceMs = ((double)cv::getTickCount() - t) * 1000. / cv::getTickFrequency();
+
+    t = (double)cv::getTickCount();
+    double fullRes = runEngine(img, markers, options);
+    double engineMs = ((double)cv::getTickCount() - t) * 1000. / cv::getTickFrequency();
+
+    std::cout << "Watershed validation: cv::watershed " << referenceMs << "ms, "
+              << engineName(options.engine) << " " << engineMs << "ms, "
+              << watershedAgreement(reference, markers) * 100 << "% of pixels agree";
+    if (options.engine == PYRAMID_WATERSHED) {
+        std::cout << ", " << fullRes * 100 << "% flooded at full resolution";
+    }
+    std::cout << std::endl;
+    if (options.engine != OPENCV_WATERSHED) {
+        printMismatches(img, reference, markers, options.engine == PARALLEL_WATERSHED);
+    }
+}
+
+double watershedAgreement(const cv::Mat& markers1, const cv::Mat& markers2) {
+    CV_Assert(markers1.size() == markers2.size() && markers1.type() == CV_32S && markers2.type() == CV_32S);
+
+    size_t compared = 0, same = 0;
+    for (int i = 0; i < markers1.rows; ++i) {
+        const int* row1 = markers1.ptr<int>(i);
+        const int* row2 = markers2.ptr<int>(i);
+        for (int j = 0; j < markers1.cols; ++j) {
+            if (row1[j] == WSHED && row2[j] == WSHED) {
+                continue;
+            }
+            compared++;
+            same += row1[j] == row2[j];
+        }
+    }
+
+    return compared ? (double)same / compared : 1.;
+}
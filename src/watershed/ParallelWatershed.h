@@ -0,0 +1,47 @@
+#ifndef PARALLEL_WATERSHED_H
+#define PARALLEL_WATERSHED_H
+
+#include "opencv2/imgproc.hpp"
+
+enum WatershedEngine {
+    // cv::watershed
+    OPENCV_WATERSHED,
+    // parallelWatershed
+    PARALLEL_WATERSHED,
+    // pyramidWatershed
+    PYRAMID_WATERSHED
+};
+
+struct WatershedOptions {
+    WatershedOptions(WatershedEngine engine = OPENCV_WATERSHED)
+        : engine(engine), validate(false), pyramidLevels(2), pyramidBand(4), resolveBoundaries(false) {}
+
+    WatershedEngine engine;
+    // runs cv::watershed too and reports how well the engine agrees with it and where it doesn't
+    bool validate;
+    // PYRAMID_WATERSHED: flooding runs on 1 / 2^pyramidLevels downsampled image,
+    // then again at full resolution only within pyramidBand pixels (plus one coarse pixel)
+    // of coarse boundaries
+    int pyramidLevels;
+    int pyramidBand;
+    // runWatershed assigns boundary pixels to neighbouring regions instead of painting them with boundaryLabel
+    bool resolveBoundaries;
+};
+
+// Meyer's flooding with the same inputs and output as cv::watershed
+// (img is CV_8UC3, markers is CV_32S with seeds > 0, result has -1 on boundaries).
+// Image rows are split into strips which are flooded in parallel priority level by level:
+// a round floods the level within every strip, then pixels on the seams between strips are settled
+// sequentially, and rounds repeat only while the seams queued more pixels of the level.
+// With one strip the flooding order is exactly the one of cv::watershed, with more strips
+// the order of equal priorities can differ on plateaus reaching over seams.
+// strips <= 0 means one strip per OpenCV thread.
+void parallelWatershed(const cv::Mat& img, cv::Mat& markers, int strips = 0);
+
+// Floods markers with the chosen engine
+void floodWatershed(const cv::Mat& img, cv::Mat& markers, const WatershedOptions& options);
+
+// Fraction of pixels which are not boundaries in both results and have the same region index
+double watershedAgreement(const cv::Mat& markers1, const cv::Mat& markers2);
+
+#endif // PARALLEL_WATERSHED_H
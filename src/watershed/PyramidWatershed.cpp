@@ -0,0 +1,124 @@
+#include "opencv2/core/utility.hpp"
+
+#include "PyramidWatershed.h"
+
+namespace {
+
+// coarse level side has to leave room for the frame cv::watershed draws around the image
+const int MIN_COARSE_SIDE = 16;
+
+inline int ceilDiv(int a, int b) {
+    return (a + b - 1) / b;
+}
+
+} // namespace
+
+double pyramidWatershed(const cv::Mat& img, cv::Mat& markers, int levels, int band) {
+    CV_Assert(img.type() == CV_8UC3 && markers.type() == CV_32SC1 && img.size() == markers.size());
+
+    const int scale = 1 << std::max(levels, 0);
+    const int rows = img.rows, cols = img.cols;
+    const int crows = ceilDiv(rows, scale), ccols = ceilDiv(cols, scale);
+    if (levels <= 0 || std::min(crows, ccols) < MIN_COARSE_SIDE) {
+        cv::watershed(img, markers);
+        return 1.;
+    }
+
+    // pyrDown rounds sizes up, so after `levels` steps the coarse image is exactly crows x ccols
+    cv::Mat coarseImg = img;
+    for (int l = 0; l < levels; ++l) {
+        cv::Mat down;
+        cv::pyrDown(coarseImg, down);
+        coarseImg = down;
+    }
+    CV_Assert(coarseImg.rows == crows && coarseImg.cols == ccols);
+
+    // a coarse pixel gets the first seed of its scale x scale block
+    cv::Mat coarseMarkers(crows, ccols, CV_32SC1);
+    cv::parallel_for_(cv::Range(0, crows), [&](const cv::Range& range) {
+        for (int cy = range.start; cy < range.end; ++cy) {
+            int* dst = coarseMarkers.ptr<int>(cy);
+            const int y1 = std::min((cy + 1) * scale, rows);
+            for (int cx = 0; cx < ccols; ++cx) {
+                const int x0 = cx * scale, x1 = std::min(x0 + scale, cols);
+                int seed = 0;
+                for (int y = cy * scale; y < y1 && !seed; ++y) {
+                    const int* src = markers.ptr<int>(y);
+                    for (int x = x0; x < x1; ++x) {
+                        if (src[x] > 0) {
+                            seed = src[x];
+                            break;
+                        }
+                    }
+                }
+                dst[cx] = seed;
+            }
+        }
+    });
+
+    cv::watershed(coarseImg, coarseMarkers);
+
+    // coarse pixels which have to be flooded again: boundaries, their 4-neighbours
+    // and blocks containing a seed the coarse label does not agree with
+    cv::Mat unstable(crows, ccols, CV_8UC1);
+    cv::parallel_for_(cv::Range(0, crows), [&](const cv::Range& range) {
+        for (int cy = range.start; cy < range.end; ++cy) {
+            const int* row = coarseMarkers.ptr<int>(cy);
+            const int* up = coarseMarkers.ptr<int>(std::max(cy - 1, 0));
+            const int* down = coarseMarkers.ptr<int>(std::min(cy + 1, crows - 1));
+            uchar* dst = unstable.ptr<uchar>(cy);
+            const int y1 = std::min((cy + 1) * scale, rows);
+            for (int cx = 0; cx < ccols; ++cx) {
+                const int label = row[cx];
+                bool flood = label <= 0 || up[cx] != label || down[cx] != label
+                        || row[std::max(cx - 1, 0)] != label || row[std::min(cx + 1, ccols - 1)] != label;
+
+                const int x0 = cx * scale, x1 = std::min(x0 + scale, cols);
+                for (int y = cy * scale; y < y1 && !flood; ++y) {
+                    const int* src = markers.ptr<int>(y);
+                    for (int x = x0; x < x1; ++x) {
+                        if (src[x] > 0 && src[x] != label) {
+                            flood = true;
+                            break;
+                        }
+                    }
+                }
+                dst[cx] = flood ? 255 : 0;
+            }
+        }
+    });
+
+    // full resolution band around unstable blocks
+    cv::Mat bandMask(rows, cols, CV_8UC1);
+    cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& range) {
+        for (int y = range.start; y < range.end; ++y) {
+            const uchar* src = unstable.ptr<uchar>(y / scale);
+            uchar* dst = bandMask.ptr<uchar>(y);
+            for (int x = 0; x < cols; ++x) {
+                dst[x] = src[x / scale];
+            }
+        }
+    });
+    if (band > 0) {
+        cv::dilate(bandMask, bandMask,
+                   cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2 * band + 1, 2 * band + 1)));
+    }
+
+    // stable pixels take the upsampled label, the band keeps only the original seeds
+    cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& range) {
+        for (int y = range.start; y < range.end; ++y) {
+            const int* src = coarseMarkers.ptr<int>(y / scale);
+            const uchar* inBand = bandMask.ptr<uchar>(y);
+            int* dst = markers.ptr<int>(y);
+            for (int x = 0; x < cols; ++x) {
+                if (!inBand[x]) {
+                    dst[x] = src[x / scale];
+                }
+            }
+        }
+    });
+
+    cv::watershed(img, markers);
+
+    return (double)cv::countNonZero(bandMask) / ((double)rows * cols);
+}
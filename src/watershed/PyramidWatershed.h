@@ -0,0 +1,14 @@
+#ifndef PYRAMID_WATERSHED_H
+#define PYRAMID_WATERSHED_H
+
+#include "opencv2/imgproc.hpp"
+
+// Multi-resolution flooding with the same inputs and output as cv::watershed.
+// Seeds are flooded on the image downsampled `levels` times with cv::pyrDown, the coarse labels
+// are upsampled and kept where they are stable. Pixels within `band` pixels of coarse boundaries,
+// of unlabelled coarse pixels and of seeds the coarse level lost are flooded again at full resolution.
+// Falls back to cv::watershed when the coarse image would be too small.
+// Returns the fraction of pixels which were flooded at full resolution.
+double pyramidWatershed(const cv::Mat& img, cv::Mat& markers, int levels, int band);
+
+#endif // PYRAMID_WATERSHED_H
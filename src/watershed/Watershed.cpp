@@ -1,55 +1,485 @@
+#include "opencv2/core/utility.hpp"
 #include "opencv2/imgproc.hpp"
 
-cv::Mat runWatershed(const cv::Mat& img0, const cv::Mat& markerMask) {
-    int i, j, compCount = 0;
+#include <bitset>
+#include <mutex>
+
+#include "Palette.h"
+#include "Trace.h"
+#include "Watershed.h"
+
+namespace {
+
+// no region label assigned yet, region labels are never 0
+const uchar NO_REGION_LABEL = 0;
+
+inline cv::Rect inflate(const cv::Rect& rect, int d) {
+    return cv::Rect(rect.x - d, rect.y - d, rect.width + 2 * d, rect.height + 2 * d);
+}
+
+// Numbers connected components of markerMask starting from 1, returns their count
+int seedMarkers(const cv::Mat& markerMask, cv::Mat& markers) {
+    int compCount = 0;
     std::vector<std::vector<cv::Point> > contours;
     std::vector<cv::Vec4i> hierarchy;
 
     findContours(markerMask, contours, hierarchy, cv::RETR_CCOMP, cv::CHAIN_APPROX_SIMPLE);
 
     if( contours.empty() )
-        return cv::Mat();
+        return 0;
 
-    cv::Mat markers(markerMask.size(), CV_32S);
+    markers.create(markerMask.size(), CV_32S);
     markers = cv::Scalar::all(0);
     int idx = 0;
     for( ; idx >= 0; idx = hierarchy[idx][0], compCount++ )
         drawContours(markers, contours, idx, cv::Scalar::all(compCount+1), -1, 8, hierarchy, INT_MAX);
 
-    if( compCount == 0 )
-        return cv::Mat();
+    return compCount;
+}
+
+// Collects pairs of regions touching through boundary pixels inside rect
+void addNeighbours(const cv::Mat& markers, const cv::Rect& rect, int compCount,
+                   std::vector<std::set<int> >& neighbours) {
+    for (int i = rect.y; i < rect.y + rect.height; i++) {
+        const int* row = markers.ptr<int>(i);
+        for (int j = rect.x; j < rect.x + rect.width; j++) {
+            if (row[j] != -1) {
+                continue;
+            }
+
+            int found[8];
+            int foundCnt = 0;
+            for (int di = -1; di <= 1; di++) {
+                for (int dj = -1; dj <= 1; dj++) {
+                    int y = i + di, x = j + dj;
+                    if (y < 0 || y >= markers.rows || x < 0 || x >= markers.cols) {
+                        continue;
+                    }
+                    int index = markers.at<int>(y, x);
+                    if (index > 0 && index <= compCount &&
+                            std::find(found, found + foundCnt, index) == found + foundCnt) {
+                        found[foundCnt++] = index;
+                    }
+                }
+            }
+
+            for (int a = 0; a < foundCnt; a++) {
+                for (int b = 0; b < foundCnt; b++) {
+                    if (a != b) {
+                        neighbours[found[a]].insert(found[b]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Grows bounding rects of regions by their pixels inside rect
+void addRegionRects(const cv::Mat& markers, const cv::Rect& rect, int compCount,
+                    std::vector<cv::Rect>& regionRects) {
+    for (int i = rect.y; i < rect.y + rect.height; i++) {
+        const int* row = markers.ptr<int>(i);
+        for (int j = rect.x; j < rect.x + rect.width; j++) {
+            int index = row[j];
+            if (index <= 0 || index > compCount) {
+                continue;
+            }
+            cv::Rect& r = regionRects[index];
+            if (r.area() == 0) {
+                r = cv::Rect(j, i, 1, 1);
+            } else {
+                r |= cv::Rect(j, i, 1, 1);
+            }
+        }
+    }
+}
+
+// Gives region one of the region labels so that touching regions never share a label
+// (and a flood fill in the mask window never leaks into a neighbour),
+// even when there are more regions than labels. Keeps preferred label if it's free.
+uchar pickRegionLabel(int index, const WatershedState& state, uchar preferred = NO_REGION_LABEL) {
+    std::bitset<REGION_LABEL_COUNT> used;
+    const std::set<int>& neighbours = state.neighbours[index];
+    for (std::set<int>::const_iterator it = neighbours.begin(); it != neighbours.end(); ++it) {
+        uchar label = state.regionLabels[*it];
+        if (label != NO_REGION_LABEL) {
+            used.set(label - firstRegionLabel);
+        }
+    }
 
-    std::vector<cv::Vec3b> colorTab;
-    for( i = 0; i < compCount; i++ )
+    if (preferred != NO_REGION_LABEL && !used[preferred - firstRegionLabel]) {
+        return preferred;
+    }
+
+    int slot = (index - 1) % REGION_LABEL_COUNT;
+    for (int k = 0; k < REGION_LABEL_COUNT && used[slot]; k++) {
+        slot = (slot + 1) % REGION_LABEL_COUNT;
+    }
+    return (uchar)(firstRegionLabel + slot);
+}
+
+// boundaryCols gets columns of boundary pixels if given
+void paintRow(const int* markersRow, uchar* wshedRow, int width, const WatershedState& state,
+              std::vector<int>* boundaryCols = 0) {
+    for (int j = 0; j < width; j++)
     {
-        int b = cv::theRNG().uniform(0, 255);
-        int g = cv::theRNG().uniform(0, 255);
-        int r = cv::theRNG().uniform(0, 255);
+        int index = markersRow[j];
+        if( index == -1 ) {
+            wshedRow[j] = boundaryLabel;
+            if (boundaryCols)
+                boundaryCols->push_back(j);
+        }
+        else if( index <= 0 || index > state.compCount )
+            wshedRow[j] = unknownLabel;
+        else
+            wshedRow[j] = state.regionLabels[index];
+    }
+}
+
+// paint the watershed image, boundaries gets all boundary pixels (in no particular order) if given
+void paintLabels(const cv::Rect& rect, WatershedState& state, std::vector<cv::Point>* boundaries = 0) {
+    std::mutex mutex;
+    cv::parallel_for_(cv::Range(rect.y, rect.y + rect.height), [&](const cv::Range& range) {
+        std::vector<cv::Point> found;
+        std::vector<int> cols;
+        for (int i = range.start; i < range.end; i++) {
+            paintRow(state.markers.ptr<int>(i) + rect.x, state.labels.ptr<uchar>(i) + rect.x, rect.width, state,
+                     boundaries ? &cols : 0);
+            for (size_t k = 0; k < cols.size(); k++) {
+                found.push_back(cv::Point(rect.x + cols[k], i));
+            }
+            cols.clear();
+        }
+        if (boundaries && !found.empty()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            boundaries->insert(boundaries->end(), found.begin(), found.end());
+        }
+    });
+}
+
+// Region most of the 8 neighbours of pixel belong to (the smallest index on ties), 0 if there are none
+int majorityRegion(const cv::Mat& markers, const cv::Point& p, int compCount) {
+    int found[8], counts[8];
+    int foundCnt = 0;
+    for (int di = -1; di <= 1; di++) {
+        const int y = p.y + di;
+        if (y < 0 || y >= markers.rows) {
+            continue;
+        }
+        const int* row = markers.ptr<int>(y);
+        for (int dj = -1; dj <= 1; dj++) {
+            const int x = p.x + dj;
+            if ((di == 0 && dj == 0) || x < 0 || x >= markers.cols) {
+                continue;
+            }
+            const int index = row[x];
+            if (index <= 0 || index > compCount) {
+                continue;
+            }
+            int k = (int)(std::find(found, found + foundCnt, index) - found);
+            if (k == foundCnt) {
+                found[foundCnt] = index;
+                counts[foundCnt++] = 0;
+            }
+            counts[k]++;
+        }
+    }
+
+    int best = 0, bestCount = 0;
+    for (int k = 0; k < foundCnt; k++) {
+        if (counts[k] > bestCount || (counts[k] == bestCount && found[k] < best)) {
+            best = found[k];
+            bestCount = counts[k];
+        }
+    }
+    return best;
+}
+
+// Assigns boundary pixels of state to their majority neighbouring region, both in markers and labels.
+// Work is proportional to the number of boundary pixels. Pixels without any region around
+// (crossings of boundaries) wait for the next round, every round sees markers as the previous one left them,
+// so the result doesn't depend on the order of boundaries.
+void resolveBoundaries(std::vector<cv::Point>& boundaries, WatershedState& state) {
+    TRACE_SCOPE("watershed/boundaries");
+    std::vector<int> regions;
+    while (!boundaries.empty()) {
+        regions.resize(boundaries.size());
+        cv::parallel_for_(cv::Range(0, (int)boundaries.size()), [&](const cv::Range& range) {
+            for (int k = range.start; k < range.end; k++) {
+                regions[k] = majorityRegion(state.markers, boundaries[k], state.compCount);
+            }
+        });
+
+        size_t pending = 0;
+        for (size_t k = 0; k < boundaries.size(); k++) {
+            const cv::Point& p = boundaries[k];
+            if (regions[k] > 0) {
+                state.markers.at<int>(p) = regions[k];
+                state.labels.at<uchar>(p) = state.regionLabels[regions[k]];
+            } else {
+                boundaries[pending++] = p;
+            }
+        }
+        if (pending == boundaries.size()) {
+            // no regions at all, boundaries stay as they are
+            break;
+        }
+        boundaries.resize(pending);
+    }
+}
 
-        colorTab.push_back(cv::Vec3b((uchar)b, (uchar)g, (uchar)r));
+} // namespace
+
+cv::Mat runWatershed(const cv::Mat& img0, const cv::Mat& markerMask, const WatershedOptions& options) {
+    WatershedState state;
+    if (!runWatershed(img0, markerMask, state, options)) {
+        return cv::Mat();
     }
+    return state.labels;
+}
+
+bool runWatershed(const cv::Mat& img0, const cv::Mat& markerMask, WatershedState& state,
+                  const WatershedOptions& options) {
+    TRACE_SCOPE("watershed");
+    state.clear();
+
+    cv::Mat markers;
+    int compCount;
+    {
+        TRACE_SCOPE("watershed/contours");
+        compCount = seedMarkers(markerMask, markers);
+    }
+
+    if( compCount == 0 )
+        return false;
 
     double t = (double)cv::getTickCount();
-    cv::watershed( img0, markers );
+    {
+        TRACE_SCOPE("watershed/flood");
+        floodWatershed( img0, markers, options );
+    }
     t = (double)cv::getTickCount() - t;
     printf( "execution time = %gms\n", t*1000./cv::getTickFrequency() );
 
-    cv::Mat wshed(markers.size(), CV_8UC3);
+    const cv::Rect imageRect(0, 0, markers.cols, markers.rows);
 
-    // paint the watershed image
-    for( i = 0; i < markers.rows; i++ ) {
-        for( j = 0; j < markers.cols; j++ )
-        {
-            int index = markers.at<int>(i,j);
-            if( index == -1 )
-                wshed.at<cv::Vec3b>(i,j) = cv::Vec3b(255,255,255);
-            else if( index <= 0 || index > compCount )
-                wshed.at<cv::Vec3b>(i,j) = cv::Vec3b(0,0,0);
-            else
-                wshed.at<cv::Vec3b>(i,j) = colorTab[index - 1];
-        }
+    state.markers = markers;
+    state.compCount = compCount;
+
+    TRACE_SCOPE("watershed/paint");
+    state.neighbours.assign(compCount + 1, std::set<int>());
+    addNeighbours(markers, imageRect, compCount, state.neighbours);
+
+    state.regionRects.assign(compCount + 1, cv::Rect());
+    addRegionRects(markers, imageRect, compCount, state.regionRects);
+
+    state.regionLabels.assign(compCount + 1, NO_REGION_LABEL);
+    for (int index = 1; index <= compCount; index++) {
+        state.regionLabels[index] = pickRegionLabel(index, state);
     }
 
-    return wshed;
+    state.labels.create(markers.size(), CV_8U);
+    if (options.resolveBoundaries) {
+        std::vector<cv::Point> boundaries;
+        paintLabels(imageRect, state, &boundaries);
+        resolveBoundaries(boundaries, state);
+    } else {
+        paintLabels(imageRect, state);
+    }
+
+    return true;
 }
 
+void renderWatershed(const WatershedState& state, const cv::Mat& gray, cv::Mat& mask, cv::Mat& preview) {
+    TRACE_SCOPE("watershed/render");
+    CV_Assert(!state.empty() && gray.type() == CV_8U && gray.size() == state.markers.size());
+
+    mask.create(state.markers.size(), CV_8U);
+    preview.create(state.markers.size(), CV_8UC3);
+
+    const cv::Vec3b* colors = labelColors();
+    const int width = state.markers.cols;
+
+    cv::parallel_for_(cv::Range(0, state.markers.rows), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end; i++) {
+            uchar* maskRow = mask.ptr<uchar>(i);
+            paintRow(state.markers.ptr<int>(i), maskRow, width, state);
+
+            // color*0.5 + gray*0.5 rounded half to even, the same as the cv::Mat expression
+            const uchar* grayRow = gray.ptr<uchar>(i);
+            uchar* previewRow = preview.ptr<uchar>(i);
+            for (int j = 0; j < width; j++) {
+                const cv::Vec3b& color = colors[maskRow[j]];
+                for (int c = 0; c < 3; c++) {
+                    int sum = color[c] + grayRow[j];
+                    int half = sum >> 1;
+                    previewRow[j * 3 + c] = (uchar)(half + (sum & half & 1));
+                }
+            }
+        }
+    });
+}
+
+bool runWatershedIncremental(const cv::Mat& img0, const cv::Mat& markerMask,
+                             const cv::Rect& dirty, WatershedState& state,
+                             const WatershedOptions& options) {
+    TRACE_SCOPE("watershed/incremental");
+    if (state.empty() || state.markers.size() != markerMask.size()) {
+        return runWatershed(img0, markerMask, state, options);
+    }
+
+    const cv::Rect imageRect(0, 0, markerMask.cols, markerMask.rows);
+    const cv::Rect dirtyRect = inflate(dirty, 1) & imageRect;
+    if (dirtyRect.area() == 0) {
+        return true;
+    }
+
+    // regions the edit touches and their neighbours
+    std::vector<char> affected(state.compCount + 1, 0);
+    std::vector<int> touched;
+    for (int i = dirtyRect.y; i < dirtyRect.y + dirtyRect.height; i++) {
+        const int* row = state.markers.ptr<int>(i);
+        for (int j = dirtyRect.x; j < dirtyRect.x + dirtyRect.width; j++) {
+            if (row[j] > 0 && !affected[row[j]]) {
+                affected[row[j]] = 1;
+                touched.push_back(row[j]);
+            }
+        }
+    }
+    for (size_t k = 0; k < touched.size(); k++) {
+        const std::set<int>& neighbours = state.neighbours[touched[k]];
+        for (std::set<int>::const_iterator it = neighbours.begin(); it != neighbours.end(); ++it) {
+            affected[*it] = 1;
+        }
+    }
+
+    cv::Rect rect = dirtyRect;
+    for (int index = 1; index <= state.compCount; index++) {
+        if (affected[index] && state.regionRects[index].area() > 0) {
+            rect |= state.regionRects[index];
+        }
+    }
+    // boundaries around affected regions
+    rect = inflate(rect, 1) & imageRect;
+
+    if (rect.area() > imageRect.area() / 2) {
+        return runWatershed(img0, markerMask, state, options);
+    }
+
+    // cv::watershed marks the outer frame of its input as boundary,
+    // so flood one pixel more than needed and don't copy that frame back
+    const cv::Rect floodRect = inflate(rect, 1) & imageRect;
+    cv::Rect copyRect = floodRect;
+    if (copyRect.x > 0) { copyRect.x++; copyRect.width--; }
+    if (copyRect.y > 0) { copyRect.y++; copyRect.height--; }
+    if (copyRect.x + copyRect.width < imageRect.width) { copyRect.width--; }
+    if (copyRect.y + copyRect.height < imageRect.height) { copyRect.height--; }
+
+    // unaffected regions stay as they are and work as fixed seeds
+    cv::Mat local(floodRect.size(), CV_32S);
+    for (int i = 0; i < floodRect.height; i++) {
+        const int* oldRow = state.markers.ptr<int>(floodRect.y + i);
+        int* row = local.ptr<int>(i);
+        for (int j = 0; j < floodRect.width; j++) {
+            int index = oldRow[floodRect.x + j];
+            row[j] = index > 0 && !affected[index] ? index : 0;
+        }
+    }
+
+    // seeds of affected regions, an unchanged seed keeps its region index (and color)
+    cv::Mat components;
+    int componentsCnt = cv::connectedComponents(markerMask(floodRect), components, 8, CV_32S);
+
+    std::vector<int> componentIndex(componentsCnt, 0);
+    for (int i = 0; i < floodRect.height; i++) {
+        const int* compRow = components.ptr<int>(i);
+        const int* oldRow = state.markers.ptr<int>(floodRect.y + i);
+        const int* row = local.ptr<int>(i);
+        for (int j = 0; j < floodRect.width; j++) {
+            int c = compRow[j];
+            if (c == 0 || row[j] != 0) {
+                continue;
+            }
+            int candidate = oldRow[floodRect.x + j] > 0 ? oldRow[floodRect.x + j] : -1;
+            if (componentIndex[c] == 0) {
+                componentIndex[c] = candidate;
+            } else if (componentIndex[c] != candidate) {
+                componentIndex[c] = -1;
+            }
+        }
+    }
+
+    const int prevCompCount = state.compCount;
+    std::vector<char> reused(prevCompCount + 1, 0);
+    for (int c = 1; c < componentsCnt; c++) {
+        if (componentIndex[c] == 0) {
+            continue;
+        }
+        if (componentIndex[c] > 0 && !reused[componentIndex[c]]) {
+            reused[componentIndex[c]] = 1;
+        } else {
+            componentIndex[c] = ++state.compCount;
+        }
+    }
+
+    for (int i = 0; i < floodRect.height; i++) {
+        const int* compRow = components.ptr<int>(i);
+        int* row = local.ptr<int>(i);
+        for (int j = 0; j < floodRect.width; j++) {
+            if (compRow[j] != 0 && row[j] == 0) {
+                row[j] = componentIndex[compRow[j]];
+            }
+        }
+    }
+
+    double t = (double)cv::getTickCount();
+    {
+        TRACE_SCOPE("watershed/flood");
+        floodWatershed( img0(floodRect), local, options );
+    }
+    t = (double)cv::getTickCount() - t;
+    printf( "execution time = %gms (incremental, %dx%d)\n", t*1000./cv::getTickFrequency(),
+            floodRect.width, floodRect.height );
+
+    local(copyRect - floodRect.tl()).copyTo(state.markers(copyRect));
+
+    TRACE_SCOPE("watershed/paint");
+    // update region bookkeeping of everything which could change
+    state.regionLabels.resize(state.compCount + 1, NO_REGION_LABEL);
+    state.regionRects.resize(state.compCount + 1, cv::Rect());
+    state.neighbours.resize(state.compCount + 1);
+    affected.resize(state.compCount + 1, 1);
+
+    std::vector<uchar> prevLabels(state.regionLabels);
+    for (int index = 1; index <= state.compCount; index++) {
+        if (!affected[index]) {
+            continue;
+        }
+        const std::set<int>& neighbours = state.neighbours[index];
+        for (std::set<int>::const_iterator it = neighbours.begin(); it != neighbours.end(); ++it) {
+            state.neighbours[*it].erase(index);
+        }
+        state.neighbours[index].clear();
+        state.regionRects[index] = cv::Rect();
+        state.regionLabels[index] = NO_REGION_LABEL;
+    }
+
+    addNeighbours(state.markers, copyRect, state.compCount, state.neighbours);
+    addRegionRects(state.markers, copyRect, state.compCount, state.regionRects);
+
+    for (int index = 1; index <= state.compCount; index++) {
+        if (affected[index]) {
+            state.regionLabels[index] = pickRegionLabel(index, state, prevLabels[index]);
+        }
+    }
+
+    if (options.resolveBoundaries) {
+        std::vector<cv::Point> boundaries;
+        paintLabels(copyRect, state, &boundaries);
+        resolveBoundaries(boundaries, state);
+    } else {
+        paintLabels(copyRect, state);
+    }
+
+    return true;
+}
@@ -1,6 +1,49 @@
 #ifndef WATERSHED_H
 #define WATERSHED_H
 
-cv::Mat runWatershed(const cv::Mat& img0, const cv::Mat& markerMask);
+#include "opencv2/imgproc.hpp"
+
+#include <set>
+
+#include "ParallelWatershed.h"
+
+// Result of the last watershed run, lets the next run recompute only what changed
+struct WatershedState {
+    WatershedState() : compCount(0) {}
+
+    bool empty() const { return markers.empty(); }
+    void clear() { *this = WatershedState(); }
+
+    // CV_32S cv::watershed output, regions are numbered [1, compCount], -1 are boundaries
+    cv::Mat markers;
+    // CV_8U painted markers, see runWatershed
+    cv::Mat labels;
+    int compCount;
+    // per region index
+    std::vector<uchar> regionLabels;
+    std::vector<cv::Rect> regionRects;
+    std::vector<std::set<int> > neighbours;
+};
+
+// Returns CV_8U label mask: every region gets its own region label,
+// boundaries between regions are marked with boundaryLabel
+// (or belong to one of the regions they separate, see WatershedOptions::resolveBoundaries)
+cv::Mat runWatershed(const cv::Mat& img0, const cv::Mat& markerMask,
+                     const WatershedOptions& options = WatershedOptions());
+
+// Same as above, keeps the result in state. Returns false if there are no markers.
+bool runWatershed(const cv::Mat& img0, const cv::Mat& markerMask, WatershedState& state,
+                  const WatershedOptions& options = WatershedOptions());
+
+// Writes labels of state into mask (CV_8U) and their colors blended half and half with
+// gray (CV_8U) into preview (CV_8UC3) in one row-parallel pass. Buffers of the right size are reused.
+void renderWatershed(const WatershedState& state, const cv::Mat& gray, cv::Mat& mask, cv::Mat& preview);
+
+// Updates state after markerMask has changed only inside dirty rect:
+// floods again only regions touching dirty rect and their neighbours, the rest is reused.
+// Falls back to the full run when there is no previous result or the edit is too large.
+bool runWatershedIncremental(const cv::Mat& img0, const cv::Mat& markerMask,
+                             const cv::Rect& dirty, WatershedState& state,
+                             const WatershedOptions& options = WatershedOptions());
 
 #endif // WATERSHED_H